@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "bench.h"
+#include "uring.h"
+
+/*
+ * Benchmark suite for /dev/asgn1.
+ *
+ * The device is filled with size_mb MiB, then every combination of
+ * pattern, access mode, block size, queue depth and thread count is run
+ * for a fixed time. Each run reports throughput, IOPS and p50/p99/p99.9
+ * latency, as a table, CSV or JSON, so results can be kept and compared
+ * across driver changes.
+ *
+ * Patterns are seqread, seqwrite, randread and randwrite. Sequential
+ * threads each walk their own slice of the device; random ones pick block
+ * aligned offsets anywhere in it. The read mode uses pread()/pwrite(), or
+ * io_uring with depth requests in flight per thread when the queue depth
+ * is above 1; io_uring is driven through the raw system calls so no
+ * liburing is needed. The mmap mode copies blocks to and from a shared
+ * mapping of the device and ignores the queue depth. All threads share
+ * one open file, as the device admits one opener by default.
+ *
+ * usage: asgn1_bench [-d device] [-s size_mb] [-T seconds] [-b blocks]
+ *                    [-q depths] [-t threads] [-p patterns] [-m modes]
+ *                    [-f text|csv|json]
+ *
+ * Lists are comma separated; block sizes take k and m suffixes. By
+ * default blocks run from 512 bytes to 16 MiB in steps of 4x.
+ */
+
+#define MAX_LIST 16
+#define MAX_DEPTH 64
+
+/* latency histogram: 32 linear steps per power of two, about 3% error */
+#define SUB_BITS 5
+#define SUB (1 << SUB_BITS)
+#define HIST_SIZE (64 * SUB)
+
+enum pattern { SEQREAD, SEQWRITE, RANDREAD, RANDWRITE, NR_PATTERNS };
+enum mode { MODE_READ, MODE_MMAP, NR_MODES };
+enum format { TEXT, CSV, JSON };
+
+static const char *pattern_names[NR_PATTERNS] = {
+    "seqread", "seqwrite", "randread", "randwrite"};
+static const char *mode_names[NR_MODES] = {"read", "mmap"};
+
+struct run {
+    enum pattern pattern;
+    enum mode mode;
+    size_t block;
+    unsigned depth;
+    unsigned threads;
+    size_t size;
+    int fd;
+    char *map;
+    uint64_t deadline;
+};
+
+struct worker {
+    pthread_t thread;
+    struct run *run;
+    unsigned id;
+    uint64_t ops;
+    uint64_t hist[HIST_SIZE];
+    int err;
+};
+
+static unsigned hist_index(uint64_t ns)
+{
+    unsigned e;
+
+    if (ns < 2 * SUB)
+        return ns;
+    e = 63 - __builtin_clzll(ns) - SUB_BITS;
+    return e * SUB + (ns >> e);
+}
+
+static uint64_t hist_value(unsigned idx)
+{
+    unsigned e;
+
+    if (idx < 2 * SUB)
+        return idx;
+    e = idx / SUB - 1;
+    return (uint64_t)(idx % SUB + SUB) << e;
+}
+
+/* the latency below which fraction q of the samples fall */
+static uint64_t hist_quantile(const uint64_t *hist, uint64_t total, double q)
+{
+    uint64_t want = (uint64_t)(q * total), seen = 0;
+    unsigned i;
+
+    for (i = 0; i < HIST_SIZE; i++) {
+        seen += hist[i];
+        if (seen > want)
+            return hist_value(i);
+    }
+    return 0;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* the offset of the next request of worker w */
+static off_t next_offset(struct worker *w, off_t *pos, uint64_t *rng)
+{
+    struct run *run = w->run;
+    size_t blocks = run->size / run->block;
+    size_t slice = blocks / run->threads;
+    off_t off;
+
+    if (run->pattern == RANDREAD || run->pattern == RANDWRITE)
+        return (off_t)(xorshift(rng) % blocks) * run->block;
+
+    off = (off_t)(w->id * slice + *pos) * run->block;
+    *pos = (*pos + 1) % slice;
+    return off;
+}
+
+static int is_write(struct run *run)
+{
+    return run->pattern == SEQWRITE || run->pattern == RANDWRITE;
+}
+
+static void run_sync(struct worker *w, char *buf)
+{
+    struct run *run = w->run;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL * (w->id + 1), start, end = 0;
+    off_t pos = 0, off;
+    ssize_t n;
+
+    while (end < run->deadline) {
+        off = next_offset(w, &pos, &rng);
+        start = now_ns();
+        if (run->mode == MODE_MMAP) {
+            if (is_write(run))
+                memcpy(run->map + off, buf, run->block);
+            else
+                memcpy(buf, run->map + off, run->block);
+            n = run->block;
+        } else if (is_write(run)) {
+            n = pwrite(run->fd, buf, run->block, off);
+        } else {
+            n = pread(run->fd, buf, run->block, off);
+        }
+        end = now_ns();
+        if (n != (ssize_t)run->block) {
+            w->err = n < 0 ? errno : EIO;
+            return;
+        }
+        w->hist[hist_index(end - start)]++;
+        w->ops++;
+    }
+}
+
+static void run_uring(struct worker *w, char *buf)
+{
+    struct run *run = w->run;
+    int opcode = is_write(run) ? IORING_OP_WRITE : IORING_OP_READ;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL * (w->id + 1), end;
+    uint64_t issued[MAX_DEPTH];
+    unsigned slot, inflight;
+    struct uring ring;
+    off_t pos = 0;
+    int res;
+
+    if (uring_init(&ring, run->depth) < 0) {
+        w->err = errno;
+        return;
+    }
+
+    for (slot = 0; slot < run->depth; slot++) {
+        issued[slot] = now_ns();
+        uring_queue(&ring, opcode, run->fd, buf + slot * run->block,
+                    run->block, next_offset(w, &pos, &rng), slot);
+    }
+    inflight = run->depth;
+    res = uring_submit_and_wait(&ring, inflight, &slot);
+    for (;;) {
+        end = now_ns();
+        if (res != (int)run->block) {
+            w->err = res < 0 ? -res : EIO;
+            break;
+        }
+        w->hist[hist_index(end - issued[slot])]++;
+        w->ops++;
+        inflight--;
+
+        if (end < run->deadline) {
+            issued[slot] = now_ns();
+            uring_queue(&ring, opcode, run->fd, buf + slot * run->block,
+                        run->block, next_offset(w, &pos, &rng), slot);
+            inflight++;
+            res = uring_submit_and_wait(&ring, 1, &slot);
+        } else if (inflight) {
+            res = uring_submit_and_wait(&ring, 0, &slot);
+        } else {
+            break;
+        }
+    }
+    close(ring.fd);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct run *run = w->run;
+    unsigned depth = run->mode == MODE_READ ? run->depth : 1;
+    char *buf;
+
+    buf = malloc(run->block * depth);
+    if (!buf) {
+        w->err = ENOMEM;
+        return NULL;
+    }
+    memset(buf, 0x5a + w->id, run->block * depth);
+
+    if (depth > 1)
+        run_uring(w, buf);
+    else
+        run_sync(w, buf);
+
+    free(buf);
+    return NULL;
+}
+
+static void report(enum format format, struct run *run, uint64_t ops,
+                   uint64_t *hist, double secs, int *first)
+{
+    double mib = ops * (double)run->block / secs / (1024 * 1024);
+    double iops = ops / secs;
+    double p50 = hist_quantile(hist, ops, 0.50) / 1000.0;
+    double p99 = hist_quantile(hist, ops, 0.99) / 1000.0;
+    double p999 = hist_quantile(hist, ops, 0.999) / 1000.0;
+    unsigned depth = run->mode == MODE_READ ? run->depth : 1;
+
+    switch (format) {
+    case TEXT:
+        if (*first)
+            printf("%-9s %-4s %9s %5s %7s %10s %10s %10s %10s %10s\n",
+                   "pattern", "mode", "block", "depth", "threads", "MiB/s",
+                   "IOPS", "p50(us)", "p99(us)", "p999(us)");
+        printf("%-9s %-4s %9zu %5u %7u %10.1f %10.0f %10.1f %10.1f %10.1f\n",
+               pattern_names[run->pattern], mode_names[run->mode], run->block,
+               depth, run->threads, mib, iops, p50, p99, p999);
+        break;
+    case CSV:
+        if (*first)
+            printf("pattern,mode,block,depth,threads,mib_s,iops,"
+                   "p50_us,p99_us,p999_us\n");
+        printf("%s,%s,%zu,%u,%u,%.1f,%.0f,%.2f,%.2f,%.2f\n",
+               pattern_names[run->pattern], mode_names[run->mode], run->block,
+               depth, run->threads, mib, iops, p50, p99, p999);
+        break;
+    case JSON:
+        printf("%s  {\"pattern\": \"%s\", \"mode\": \"%s\", \"block\": %zu, "
+               "\"depth\": %u, \"threads\": %u, \"mib_s\": %.1f, "
+               "\"iops\": %.0f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+               "\"p999_us\": %.2f}",
+               *first ? "[\n" : ",\n", pattern_names[run->pattern],
+               mode_names[run->mode], run->block, depth, run->threads, mib,
+               iops, p50, p99, p999);
+        break;
+    }
+    fflush(stdout);
+    *first = 0;
+}
+
+/* run one combination; returns 0, or an errno */
+static int bench(struct run *run, double secs, enum format format,
+                 int *first)
+{
+    static uint64_t hist[HIST_SIZE];
+    struct worker *workers;
+    uint64_t ops = 0, start;
+    unsigned i, j;
+    int err = 0;
+
+    workers = calloc(run->threads, sizeof(*workers));
+    if (!workers)
+        return ENOMEM;
+
+    start = now_ns();
+    run->deadline = start + (uint64_t)(secs * 1e9);
+    for (i = 0; i < run->threads; i++) {
+        workers[i].run = run;
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, worker_main,
+                           &workers[i])) {
+            run->deadline = 0;
+            err = EAGAIN;
+            break;
+        }
+    }
+
+    memset(hist, 0, sizeof(hist));
+    while (i-- > 0) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].err)
+            err = workers[i].err;
+        ops += workers[i].ops;
+        for (j = 0; j < HIST_SIZE; j++)
+            hist[j] += workers[i].hist[j];
+    }
+    secs = (now_ns() - start) / 1e9;
+    free(workers);
+
+    if (!err && ops)
+        report(format, run, ops, hist, secs, first);
+    return err;
+}
+
+static size_t parse_size(const char *s)
+{
+    char *end;
+    size_t v = strtoul(s, &end, 0);
+
+    if (*end == 'k' || *end == 'K')
+        v <<= 10;
+    else if (*end == 'm' || *end == 'M')
+        v <<= 20;
+    return v;
+}
+
+/* split a comma separated list into up to MAX_LIST sizes */
+static int parse_list(char *arg, size_t *out)
+{
+    char *tok;
+    int n = 0;
+
+    for (tok = strtok(arg, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+        out[n++] = parse_size(tok);
+    return n;
+}
+
+/* set mask bits for the names in a comma separated list */
+static unsigned parse_names(char *arg, const char **names, int nr)
+{
+    unsigned mask = 0;
+    char *tok;
+    int i;
+
+    for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        for (i = 0; i < nr; i++)
+            if (!strcmp(tok, names[i]))
+                mask |= 1u << i;
+        if (!strcmp(tok, "all"))
+            mask = (1u << nr) - 1;
+    }
+    return mask;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: asgn1_bench [-d device] [-s size_mb] [-T seconds] "
+            "[-b blocks] [-q depths]\n"
+            "                   [-t threads] [-p patterns] [-m modes] "
+            "[-f text|csv|json]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *filename = "/dev/asgn1";
+    size_t size = 64UL * 1024 * 1024, done;
+    size_t blocks[MAX_LIST] = {512, 2048, 8192, 32768, 131072, 524288,
+                               2097152, 8388608, 16777216};
+    size_t depths[MAX_LIST] = {1}, threads[MAX_LIST] = {1};
+    int nblocks = 9, ndepths = 1, nthreads = 1;
+    unsigned patterns = (1u << NR_PATTERNS) - 1, modes = (1u << NR_MODES) - 1;
+    enum format format = TEXT;
+    double secs = 2;
+    struct run run;
+    int b, q, t, p, m, fd, opt, err, first = 1;
+    char *buf;
+
+    while ((opt = getopt(argc, argv, "d:s:T:b:q:t:p:m:f:")) != -1) {
+        switch (opt) {
+        case 'd':
+            filename = optarg;
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 0) * 1024 * 1024;
+            break;
+        case 'T':
+            secs = atof(optarg);
+            break;
+        case 'b':
+            nblocks = parse_list(optarg, blocks);
+            break;
+        case 'q':
+            ndepths = parse_list(optarg, depths);
+            break;
+        case 't':
+            nthreads = parse_list(optarg, threads);
+            break;
+        case 'p':
+            patterns = parse_names(optarg, pattern_names, NR_PATTERNS);
+            break;
+        case 'm':
+            modes = parse_names(optarg, mode_names, NR_MODES);
+            break;
+        case 'f':
+            if (!strcmp(optarg, "csv"))
+                format = CSV;
+            else if (!strcmp(optarg, "json"))
+                format = JSON;
+            else if (strcmp(optarg, "text"))
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    if (!size || secs <= 0 || !patterns || !modes)
+        usage();
+    for (q = 0; q < ndepths; q++)
+        if (depths[q] < 1 || depths[q] > MAX_DEPTH) {
+            fprintf(stderr, "queue depth must be 1..%d\n", MAX_DEPTH);
+            exit(1);
+        }
+
+    /* truncate and fill the device */
+    if (!(buf = malloc(1 << 20))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(buf, 0x3c, 1 << 20);
+    if ((fd = open(filename, O_WRONLY)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    for (done = 0; done < size; done += 1 << 20) {
+        size_t len = size - done < (1 << 20) ? size - done : 1 << 20;
+
+        if (write(fd, buf, len) != (ssize_t)len) {
+            fprintf(stderr, "write problem:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    close(fd);
+    free(buf);
+
+    if ((fd = open(filename, O_RDWR)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    run.fd = fd;
+    run.size = size;
+    run.map = NULL;
+    if (modes & (1u << MODE_MMAP)) {
+        run.map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (run.map == MAP_FAILED) {
+            fprintf(stderr, "mmap failed:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    for (p = 0; p < NR_PATTERNS; p++) {
+        if (!(patterns & (1u << p)))
+            continue;
+        for (m = 0; m < NR_MODES; m++) {
+            if (!(modes & (1u << m)))
+                continue;
+            for (b = 0; b < nblocks; b++) {
+                for (t = 0; t < nthreads; t++) {
+                    /* each thread needs at least one block of its own */
+                    if (!blocks[b] || !threads[t] ||
+                        blocks[b] * threads[t] > size)
+                        continue;
+                    for (q = 0; q < ndepths; q++) {
+                        /* the depth means nothing to mmap */
+                        if (m == MODE_MMAP && q > 0)
+                            break;
+                        run.pattern = p;
+                        run.mode = m;
+                        run.block = blocks[b];
+                        run.depth = depths[q];
+                        run.threads = threads[t];
+                        err = bench(&run, secs, format, &first);
+                        if (err)
+                            fprintf(stderr, "%s %s block %zu depth %zu "
+                                    "threads %zu failed:  %s\n",
+                                    pattern_names[p], mode_names[m],
+                                    blocks[b], depths[q], threads[t],
+                                    strerror(err));
+                    }
+                }
+            }
+        }
+    }
+    if (format == JSON)
+        printf(first ? "[]\n" : "\n]\n");
+
+    if (run.map)
+        munmap(run.map, size);
+    close(fd);
+    return 0;
+}
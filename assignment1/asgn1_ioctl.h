@@ -0,0 +1,112 @@
+/**
+ * File: asgn1_ioctl.h
+ *
+ * ioctl commands understood by the asgn1 ramdisk, shared by the module and
+ * the user space tools.
+ */
+
+#ifndef _ASGN1_IOCTL_H
+#define _ASGN1_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MYIOC_TYPE 'k'
+
+/**
+ * A byte range of the device, for the range commands below.
+ */
+struct asgn1_range
+{
+  __u64 offset;
+  __u64 len;
+};
+
+/* set the maximum number of processes that may have the device open */
+#define SET_NPROC_OP 1
+#define TEM_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int)
+
+/* set how many freed pages the device keeps for reuse */
+#define SET_POOL_OP 2
+#define TEM_SET_POOL _IOW(MYIOC_TYPE, SET_POOL_OP, int)
+
+/* set the data size, freeing every page past the new end */
+#define TRUNCATE_OP 3
+#define TEM_TRUNCATE _IOW(MYIOC_TYPE, TRUNCATE_OP, __u64)
+
+/* free the pages inside a range and zero its partial pages */
+#define PUNCH_HOLE_OP 4
+#define TEM_PUNCH_HOLE _IOW(MYIOC_TYPE, PUNCH_HOLE_OP, struct asgn1_range)
+
+/* allocate the pages of a range ahead of time; the data size is kept */
+#define PREALLOC_OP 5
+#define TEM_PREALLOC _IOW(MYIOC_TYPE, PREALLOC_OP, struct asgn1_range)
+
+/* replace the device's snapshot minor with a read-only copy of it */
+#define SNAPSHOT_OP 6
+#define TEM_SNAPSHOT _IO(MYIOC_TYPE, SNAPSHOT_OP)
+
+/* as TEM_SNAPSHOT, but the copy can be opened for writing */
+#define CLONE_OP 7
+#define TEM_CLONE _IO(MYIOC_TYPE, CLONE_OP)
+
+/* cap the memory the device holds, in bytes (0 for none), evicting pages
+   to stay under it */
+#define SET_MEM_LIMIT_OP 8
+#define TEM_SET_MEM_LIMIT _IOW(MYIOC_TYPE, SET_MEM_LIMIT_OP, __u64)
+
+/* wake a ring device's consumers sleeping in poll() or read() */
+#define RING_KICK_OP 9
+#define TEM_RING_KICK _IO(MYIOC_TYPE, RING_KICK_OP)
+
+/**
+ * A range of another open asgn1 device, or of this one, to clone into
+ * this device, as FICLONERANGE takes it.
+ */
+struct asgn1_clone_range
+{
+  __s64 src_fd;
+  __u64 src_offset;
+  __u64 src_length;
+  __u64 dest_offset;
+};
+
+/* copy a range in the kernel, sharing whole pages copy-on-write where
+   both ranges start at the same offset in a page; returns the bytes
+   cloned, which stop at the end of the source data */
+#define CLONE_RANGE_OP 10
+#define TEM_CLONE_RANGE _IOW(MYIOC_TYPE, CLONE_RANGE_OP, struct asgn1_clone_range)
+
+/**
+ * The control page of a ring device, page 0 of its mmap(); the ring data
+ * follows from page 1, size bytes of it. head and tail count bytes ever
+ * produced and consumed, so the data lives at [tail, head) modulo size
+ * and head - tail never exceeds size.
+ *
+ * A producer makes room by moving tail up to head + len - size with a
+ * compare-and-swap, overwriting the oldest data, copies in its data at
+ * head, then stores head + len with release semantics. After a full
+ * barrier it reads waiting and, if nonzero, issues TEM_RING_KICK. There
+ * is one producer at a time; write() is one.
+ *
+ * The consumer loads tail, then head with acquire semantics, and copies
+ * out data from tail. It then moves tail past what it copied with a
+ * compare-and-swap; if that fails, a producer overwrote the data
+ * meanwhile and the copy is dropped. When the ring is empty it increments
+ * waiting with a compare-and-swap, which is a full barrier, checks head
+ * once more and then sleeps in poll(), decrementing waiting the same way
+ * when it wakes. waiting counts the sleepers, so one consumer waking does
+ * not hide another still asleep. read() does all this.
+ */
+struct asgn1_ring_ctl
+{
+  __u64 head;    /* written by the producer */
+  __u64 pad1[7];
+  __u64 tail;    /* written by the consumer, or a producer overwriting */
+  __u32 waiting; /* consumers asleep; changed by compare-and-swap */
+  __u32 pad2;
+  __u64 pad3[6];
+  __u64 size;    /* bytes of ring data, a power of two; read-only */
+};
+
+#endif /* _ASGN1_IOCTL_H */
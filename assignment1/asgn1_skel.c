@@ -12,8 +12,14 @@
  * answer for the assignment. So students are free to change any part of
  * the template to fit their design, not the other way around.
  *
- * Note: multiple devices and concurrent modules are not supported in this
- *       version. The template is
+ * Note: asgn1_dev_count independent devices are created, each with its
+ *       own pages, size accounting, locks and limits. Concurrent readers
+ *       and writers are supported; see the locking notes on asgn1_dev.
+ *       Each device also has a snapshot minor, filled by TEM_SNAPSHOT or
+ *       TEM_CLONE.
+ *       With blkdev_mb set, each device is also a block device,
+ *       asgn1b<n>, over the same pages. A device given a ring_kb size
+ *       is instead a fixed-size ring buffer; see struct asgn1_ring_ctl.
  */
 
 /* This program is free software; you can redistribute it and/or
@@ -27,7 +33,9 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/list.h>
+#include <linux/xarray.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/slab.h>
 #include <linux/mm.h>
 #include <linux/proc_fs.h>
@@ -35,500 +43,4731 @@
 #include <linux/device.h>
 #include <linux/sched.h>
 #include <linux/highmem.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/gfp.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/scatterlist.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/pagemap.h>
+#include <linux/file.h>
+#include <linux/falloc.h>
+#include <linux/bvec.h>
+#include <linux/shrinker.h>
+#include <linux/percpu.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/pfn_t.h>
+#include <linux/refcount.h>
+#include <linux/math64.h>
+#include <crypto/acompress.h>
+
+/* the bulk page allocator dropped its _array suffix in 6.14 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+#define alloc_pages_bulk alloc_pages_bulk_array
+#define alloc_pages_bulk_node alloc_pages_bulk_array_node
+#endif
+
+/* blk-mq merges bios for every queue from 6.14 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+#define ASGN1_BLK_FLAGS (BLK_MQ_F_BLOCKING | BLK_MQ_F_SHOULD_MERGE)
+#else
+#define ASGN1_BLK_FLAGS BLK_MQ_F_BLOCKING
+#endif
+
+#include "asgn1_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "asgn1_trace.h"
 
 #define MYDEV_NAME "asgn1"
-#define MYIOC_TYPE 'k'
+
+/* upper bound on asgn1_dev_count */
+#define ASGN1_MAX_DEVS 64
+
+/* number of writer lock stripes; pages hash onto these by page number */
+#define ASGN1_PAGE_LOCKS 64
+
+/* pages and page_nodes allocated per batch when growing a device */
+#define ASGN1_ALLOC_BATCH 32
+
+/* largest fault-around window, in pages (2 MiB with 4 KiB pages) */
+#define ASGN1_FAULT_AROUND_MAX 512
+
+/* largest extent_order accepted (2 MiB extents with 4 KiB pages) */
+#define ASGN1_MAX_EXTENT_ORDER 9
+
+/* page numbers are ints, which bounds the size of a device */
+#define ASGN1_MAX_BYTES ((loff_t)INT_MAX << PAGE_SHIFT)
+
+/* buckets in a latency histogram; bucket i counts [2^i, 2^(i+1)) ns */
+#define ASGN1_HIST_BUCKETS 32
+
+/* pages that compress to more than this are left uncompressed */
+#define ASGN1_ZMAX (PAGE_SIZE * 3 / 4)
+
+/* xarray mark on nodes changed since they were last written to the
+   backing file */
+#define ASGN1_MARK_DIRTY XA_MARK_2
+
+/* log2 of the buckets in the dedup scan's content hash table */
+#define ASGN1_DEDUP_HASH_BITS 12
+
+/* identifies a backing file, in its header */
+#define ASGN1_BACKING_MAGIC 0x61736731626b0001ULL
+
+/* pages written to the backing file per write call at unload */
+#define ASGN1_CKPT_BATCH 256
+
+/* requests in flight per block device hardware queue */
+#define ASGN1_BLK_QUEUE_DEPTH 128
+
+/* nodes a long walk of the index looks at before letting others in */
+#define ASGN1_WALK_BATCH 256
+
+/* a page shared n ways counts 1/n of a page, in these units */
+#define ASGN1_SHARE_UNIT (1ULL << 32)
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Your Name");
 MODULE_DESCRIPTION("COSC440 asgn1");
 
 /**
- * The node structure for the memory page linked list.
+ * The compressed copy of a page. A snapshot slot shares the copies of
+ * its device rather than duplicating them, so they are refcounted.
+ */
+typedef struct asgn1_zdata_rec
+{
+  refcount_t ref;
+  u8 data[];
+} asgn1_zdata;
+
+/**
+ * The node structure for the memory page index. Nodes are stored in
+ * asgn1_dev.pages keyed by page number, so any offset can be located
+ * without walking the pages in front of it.
  */
 typedef struct page_node_rec
 {
-  struct list_head list;
-  struct page *page;
+  struct page *page;   /* the data, or NULL while compressed or on file */
+  asgn1_zdata *zdata;  /* the compressed data, or NULL */
+  unsigned int zlen;   /* bytes in zdata */
+  unsigned long atime; /* jiffies of the last access, for the compactor */
+  bool referenced;     /* accessed since the eviction hand last passed */
 } page_node;
 
+/**
+ * A log2 latency histogram.
+ */
+typedef struct asgn1_hist_rec
+{
+  atomic_long_t count[ASGN1_HIST_BUCKETS];
+} asgn1_hist;
+
+/* events counted per CPU, see asgn1_stat_keys */
+enum asgn1_stat
+{
+  ASGN1_STAT_READS,
+  ASGN1_STAT_WRITES,
+  ASGN1_STAT_READ_BYTES,
+  ASGN1_STAT_WRITE_BYTES,
+  ASGN1_STAT_FAULTS,
+  ASGN1_STAT_ALLOCS,
+  ASGN1_STAT_ALLOC_FAILS,
+  ASGN1_STAT_BUSY,
+  ASGN1_STAT_LOCAL,
+  ASGN1_STAT_REMOTE,
+  ASGN1_NR_STATS
+};
+
+/* operations timed per CPU, see asgn1_lat_keys */
+enum asgn1_lat
+{
+  ASGN1_LAT_READ,
+  ASGN1_LAT_WRITE,
+  ASGN1_LAT_MMAP,
+  ASGN1_LAT_FAULT,
+  ASGN1_NR_LATS
+};
+
+/**
+ * Event counts and log2 latency histograms, kept per CPU so the hot paths
+ * never share a cache line; readers sum them over all CPUs.
+ */
+typedef struct asgn1_stats_rec
+{
+  u64 count[ASGN1_NR_STATS];
+  u64 lat[ASGN1_NR_LATS][ASGN1_HIST_BUCKETS];
+} asgn1_stats;
+
+/*
+ * Locking: readers and writers hold sem shared, so they run in parallel;
+ * only operations that remove pages (truncation) take it exclusively.
+ * New pages are published with xa_cmpxchg(), so concurrent writers can
+ * grow the device without a global lock. Writers copying into a page hold
+ * the page_locks stripe for that page number, so writes to disjoint pages
+ * proceed in parallel while each page is updated by one writer at a time.
+ *
+ * A node's page and zdata only change under the xa_lock of the index.
+ * A node with neither a page nor zdata is still in the backing file.
+ * Nodes are only freed under zlock, by truncation and by eviction in
+ * cache_mode. Loading a page holds it, so the compressed data stays valid
+ * while it is read outside the xa_lock, and the compactor holds it while
+ * it compresses a node.
+ *
+ * With dedup, a cloned range or a snapshot, several nodes, of one device
+ * or several, may share one page. page_private() of a page counts the
+ * nodes sharing it. Nodes of different devices change it under different
+ * xa_locks, so it only changes by compare-and-swap. A shared page is
+ * never written: write() and mmap write faults give their node a private
+ * copy first, and once all but one node have let go, the last one writes
+ * the page in place again.
+ *
+ * Under a memory limit, eviction sweeps the index with a CLOCK hand. It
+ * holds zlock and only takes pages nobody else holds a reference to, so
+ * it never races with a reader, a writer or a mapping of the page.
+ */
 typedef struct asgn1_dev_t
 {
   dev_t dev; /* the device */
-  struct cdev *cdev;
-  struct list_head mem_list;
-  int num_pages;            /* number of memory pages this module currently holds */
-  size_t data_size;         /* total data size in this module */
+  struct cdev cdev;
+  struct xarray pages;      /* page_node index keyed by page number */
+  atomic_t num_pages;       /* number of memory pages this module currently holds */
+  atomic_long_t data_size;  /* total data size in this module */
+  struct rw_semaphore sem;  /* shared for I/O, exclusive for truncation */
+  struct mutex page_locks[ASGN1_PAGE_LOCKS]; /* per-page writer stripes */
   atomic_t nprocs;          /* number of processes accessing this device */
   atomic_t max_nprocs;      /* max number of processes accessing this device */
-  struct kmem_cache *cache; /* cache memory */
-  struct class *class;      /* the udev class */
+  spinlock_t open_lock;     /* orders changes to nprocs with open_queue */
+  struct list_head open_queue; /* blocking opens waiting for a slot */
+  wait_queue_head_t open_wait; /* where they sleep */
+  wait_queue_head_t data_wait; /* poll: the data grew or pages were freed */
+  int max_pages;            /* page limit for this device, 0 for none */
+  struct list_head pool;    /* recycled pages, linked through page->lru */
+  int pool_pages;           /* number of pages in pool */
+  int pool_max;             /* upper bound on pool_pages */
+  spinlock_t pool_lock;     /* protects pool, pool_pages and pool_max */
+  atomic_t extents;         /* higher-order extents allocated */
+  atomic_t extent_fallbacks; /* extents that fell back to order-0 pages */
+  struct mutex zlock;       /* serialises page loading and node freeing */
+  atomic_t zpages;          /* pages held compressed */
+  atomic_long_t zbytes;     /* bytes of compressed data */
+  asgn1_hist zlat;          /* decompression latency */
+  struct asgn1_dev_t *snapshot; /* our snapshot slot, NULL in a slot */
+  struct asgn1_dev_t *origin;   /* the device a slot copies, or NULL */
+  bool readonly;            /* a snapshot, which can't be opened for writing */
+  struct file *backing;     /* the backing file, or NULL */
+  atomic_t restored;        /* pages read back from the backing file */
+  atomic_t dirty;           /* nodes marked ASGN1_MARK_DIRTY */
+  struct mutex flush_lock;  /* one write-back of the backing file at a time */
+  struct delayed_work flush_work; /* write-behind of dirty pages */
+  atomic_long_t flushed;    /* pages written back */
+  atomic64_t flush_ns;      /* time spent writing back */
+  int flush_err;            /* last write-back error, reported by fsync */
+  asgn1_stats __percpu *stats; /* event counts and latencies */
+  atomic_t resident;        /* nodes whose page is in memory */
+  long mem_limit;           /* cap on resident pages, 0 for none */
+  unsigned long clock_hand; /* next page for eviction to look at, under zlock */
+  atomic_long_t evicted;    /* pages evicted to stay under mem_limit */
+  atomic_long_t reclaimed;  /* pages given back to the shrinker */
+  struct blk_mq_tag_set tag_set; /* the block device's queues */
+  struct gendisk *disk;     /* the block device, or NULL */
+  struct inode *mapped;     /* the inode mmap()ed through, held once the
+                               block device has to unmap pages */
+  struct page **ring;       /* ring data pages, or NULL if not a ring */
+  size_t ring_size;         /* bytes in ring, a power of two */
+  struct asgn1_ring_ctl *ring_ctl; /* the shared control page */
+  struct mutex ring_lock;   /* one write() producer at a time */
   struct device *device;    /* the udev device node */
 } asgn1_dev;
 
-asgn1_dev asgn1_device;
+/* the asgn1_dev_count devices, followed by their snapshot slots */
+asgn1_dev *asgn1_devices;
+static int asgn1_nr_devs;        /* entries in asgn1_devices */
+struct kmem_cache *asgn1_cache;  /* page_node cache shared by all devices */
+struct class *asgn1_class;       /* the udev class */
 
 int asgn1_major = 0;     /* major number of module */
 int asgn1_minor = 0;     /* minor number of module */
 int asgn1_dev_count = 1; /* number of devices */
+module_param(asgn1_dev_count, int, 0444);
+MODULE_PARM_DESC(asgn1_dev_count, "number of independent ramdisk devices");
+
+static int size_limit_mb[ASGN1_MAX_DEVS];
+static int size_limit_mb_count;
+module_param_array(size_limit_mb, int, &size_limit_mb_count, 0444);
+MODULE_PARM_DESC(size_limit_mb, "per-device memory limit in MiB, 0 for none");
+
+static int mem_limit_mb[ASGN1_MAX_DEVS];
+static int mem_limit_mb_count;
+module_param_array(mem_limit_mb, int, &mem_limit_mb_count, 0444);
+MODULE_PARM_DESC(mem_limit_mb,
+                 "per-device cap on memory held, in MiB, enforced by eviction "
+                 "(0 for none)");
+
+static bool cache_mode;
+module_param(cache_mode, bool, 0644);
+MODULE_PARM_DESC(cache_mode,
+                 "let eviction discard pages with no backing file copy; "
+                 "they read back as zeros");
+
+static struct shrinker *asgn1_shrinker;
+
+static int ring_kb[ASGN1_MAX_DEVS];
+static int ring_kb_count;
+module_param_array(ring_kb, int, &ring_kb_count, 0444);
+MODULE_PARM_DESC(ring_kb,
+                 "make the device a ring buffer of this many KiB, rounded up "
+                 "to a power of two pages (0 for none)");
+
+/* where new pages are placed on NUMA machines */
+enum asgn1_numa
+{
+  ASGN1_NUMA_LOCAL,      /* on the node of the allocating thread */
+  ASGN1_NUMA_INTERLEAVE, /* round robin over the nodes with memory */
+  ASGN1_NUMA_BIND,       /* on numa_node */
+};
+
+static const char *const asgn1_numa_names[] = {"local", "interleave", "bind"};
+
+static char *numa_policy = "local";
+module_param(numa_policy, charp, 0444);
+MODULE_PARM_DESC(numa_policy,
+                 "page placement: local (to the writer), interleave or bind");
+
+static int numa_node;
+module_param(numa_node, int, 0444);
+MODULE_PARM_DESC(numa_node, "the node pages are placed on with numa_policy=bind");
+
+static int asgn1_numa;            /* numa_policy, parsed */
+static atomic_t asgn1_numa_rotor; /* last node interleaving placed a page on */
+
+/* names of the statistics, as shown by /proc/asgn1_stats */
+static const char *const asgn1_stat_keys[ASGN1_NR_STATS] = {
+    "reads", "writes", "read_bytes", "write_bytes",
+    "faults", "page_allocs", "alloc_failures", "busy_rejections",
+    "local_accesses", "remote_accesses"};
+
+static const char *const asgn1_lat_keys[ASGN1_NR_LATS] = {
+    "read", "write", "mmap", "fault"};
+
+/* and in /proc/asgn1 */
+static const char *const asgn1_lat_names[ASGN1_NR_LATS] = {
+    "Read", "Write", "Mmap", "Fault"};
+
+static int pool_pages = 256;
+module_param(pool_pages, int, 0444);
+MODULE_PARM_DESC(pool_pages, "default number of recycled pages kept per device");
+
+static int extent_order;
+module_param(extent_order, int, 0444);
+MODULE_PARM_DESC(extent_order,
+                 "back the device with 2^order page extents (0 for single pages)");
+
+static int fault_around_pages = 16;
+module_param(fault_around_pages, int, 0644);
+MODULE_PARM_DESC(fault_around_pages,
+                 "pages mapped around each mmap fault (1 disables fault-around)");
+
+static bool eager_mmap;
+module_param(eager_mmap, bool, 0644);
+MODULE_PARM_DESC(eager_mmap, "map every existing page at mmap() time");
+
+static int compress_secs;
+module_param(compress_secs, int, 0444);
+MODULE_PARM_DESC(compress_secs,
+                 "compress pages untouched for this many seconds (0 disables)");
+
+static char *compress_alg = "lz4";
+module_param(compress_alg, charp, 0444);
+MODULE_PARM_DESC(compress_alg, "crypto compression algorithm for cold pages");
+
+static struct crypto_acomp *asgn1_ztfm; /* compression algorithm, if enabled */
+static void *asgn1_zbuf;               /* compactor output, NULL if disabled */
+static struct delayed_work asgn1_compactor;
+
+static int dedup_secs;
+module_param(dedup_secs, int, 0444);
+MODULE_PARM_DESC(dedup_secs,
+                 "scan for identical pages to share every this many seconds (0 disables)");
+
+static struct delayed_work asgn1_deduper;
+
+static char *backing_file;
+module_param(backing_file, charp, 0444);
+MODULE_PARM_DESC(backing_file,
+                 "save the devices here at unload and restore them at load "
+                 "(<file>.N for device N when there are several)");
+
+static int writeback_ms;
+module_param(writeback_ms, int, 0644);
+MODULE_PARM_DESC(writeback_ms,
+                 "write dirty pages to the backing file within this many ms "
+                 "(0 saves them at unload only)");
+
+static int dirty_background_ratio = 10;
+module_param(dirty_background_ratio, int, 0644);
+MODULE_PARM_DESC(dirty_background_ratio,
+                 "percentage of dirty pages that starts write-back at once");
+
+static int dirty_ratio = 40;
+module_param(dirty_ratio, int, 0644);
+MODULE_PARM_DESC(dirty_ratio,
+                 "percentage of dirty pages at which writers write back themselves");
+
+static int flush_kbps;
+module_param(flush_kbps, int, 0644);
+MODULE_PARM_DESC(flush_kbps,
+                 "background write-back rate limit in KiB/s (0 for none)");
+
+static struct workqueue_struct *asgn1_wq; /* write-behind, if backing_file */
+
+static int blkdev_mb;
+module_param(blkdev_mb, int, 0444);
+MODULE_PARM_DESC(blkdev_mb,
+                 "size in MiB of a block device over each device's pages "
+                 "(0 for none)");
 
 /**
- * This function frees all memory pages held by the module.
+ * The first page of a backing file. Page i of a device is stored at file
+ * page i + 1, and holes in the device are holes in the file.
  */
-void free_memory_pages(void);
-void free_memory_pages(void)
+struct asgn1_backing_header
 {
-  page_node *curr, *tmp;
+  u64 magic;
+  u32 page_size;
+  u32 reserved;
+  u64 data_size;
+};
 
-  /* Loop through the entire page list */
-  list_for_each_entry_safe(curr, tmp, &asgn1_device.mem_list, list)
-  {
-    if (curr->page)
-    {
-      __free_page(curr->page);
-    }
-    list_del(&curr->list);
-    if (asgn1_device.cache)
-    {
-      kmem_cache_free(asgn1_device.cache, curr);
-    }
-    else
-    {
-      kfree(curr);
-    }
-  }
+/**
+ * A page seen by the dedup scan, hashed by its contents.
+ */
+struct asgn1_dedup_entry
+{
+  struct hlist_node link;
+  u32 hash;
+  unsigned long index;
+};
 
-  /* reset device data size, and num_pages */
-  asgn1_device.data_size = 0;
-  asgn1_device.num_pages = 0;
+static DEFINE_HASHTABLE(asgn1_dedup_seen, ASGN1_DEDUP_HASH_BITS);
+
+/**
+ * Return the writer lock stripe covering page_no.
+ */
+static struct mutex *asgn1_page_lock(asgn1_dev *dev, int page_no)
+{
+  return &dev->page_locks[page_no % ASGN1_PAGE_LOCKS];
 }
 
 /**
- * This function opens the virtual disk, if it is opened in the write-only
- * mode, all memory pages will be freed.
+ * Raise data_size to end if it is currently smaller. Concurrent writers
+ * may finish in any order, so this must never move data_size backwards.
  */
-int asgn1_open(struct inode *, struct file *);
-int asgn1_open(struct inode *inode, struct file *filp)
+static void asgn1_extend_size(asgn1_dev *dev, size_t end)
 {
-  /* Increment process count, if exceeds max_nprocs, return -EBUSY */
-  if (atomic_read(&asgn1_device.nprocs) >= atomic_read(&asgn1_device.max_nprocs))
-  {
-    return -EBUSY;
-  }
+  long old = atomic_long_read(&dev->data_size);
+
+  while (old < (long)end &&
+         !atomic_long_try_cmpxchg(&dev->data_size, &old, end))
+    ;
+
+  /* readers polling at the old end can read on */
+  if (old < (long)end && wq_has_sleeper(&dev->data_wait))
+    wake_up_interruptible_poll(&dev->data_wait, EPOLLIN | EPOLLRDNORM);
+}
 
-  atomic_inc(&asgn1_device.nprocs);
+/**
+ * Reserve count bytes at the end of the data for an append, by moving
+ * data_size past them in one atomic step, and return where they start.
+ * Appenders never wait for each other; each then fills its own range.
+ * The caller holds dev->sem shared, so truncation can't move data_size
+ * back meanwhile.
+ */
+static loff_t asgn1_reserve(asgn1_dev *dev, size_t count)
+{
+  long old = atomic_long_read(&dev->data_size);
 
-  /* if opened in write-only mode, free all memory pages */
-  if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+  do
   {
-    free_memory_pages();
-  }
+    if (old + count > ASGN1_MAX_BYTES)
+      return -EFBIG;
+  } while (!atomic_long_try_cmpxchg(&dev->data_size, &old, old + count));
 
-  return 0; /* success */
+  return old;
 }
 
 /**
- * This function releases the virtual disk, but nothing needs to be done
- * in this case.
+ * The histogram bucket of a latency of ns nanoseconds.
  */
-int asgn1_release(struct inode *, struct file *);
-int asgn1_release(struct inode *inode, struct file *filp)
+static int asgn1_hist_bucket(u64 ns)
 {
-  /* decrement process count */
-  atomic_dec(&asgn1_device.nprocs);
-  return 0;
+  return min(ns ? ilog2(ns) : 0, ASGN1_HIST_BUCKETS - 1);
 }
 
 /**
- * This function reads contents of the virtual disk and writes to the user
+ * Add n to the count of stat on this CPU.
  */
-ssize_t asgn1_read(struct file *, char __user *, size_t, loff_t *);
-ssize_t asgn1_read(struct file *filp, char __user *buf, size_t count,
-                   loff_t *f_pos)
+static void asgn1_count(asgn1_dev *dev, enum asgn1_stat stat, u64 n)
 {
-  size_t size_read = 0;                   /* size read from virtual disk in this function */
-  size_t begin_offset;                    /* the offset from the beginning of a page to
-                           start reading */
-  int begin_page_no = *f_pos / PAGE_SIZE; /* the first page which contains
-               the requested data */
-  int curr_page_no = 0;                   /* the current page number */
-  size_t curr_size_read;                  /* size read from the virtual disk in this round */
-  size_t size_to_be_read;                 /* size to be read in the current round in
-                           while loop */
+  this_cpu_add(dev->stats->count[stat], n);
+}
 
-  struct list_head *ptr = asgn1_device.mem_list.next;
-  page_node *curr;
+/**
+ * Record a sample of lat, taking ns nanoseconds, on this CPU.
+ */
+static void asgn1_time(asgn1_dev *dev, enum asgn1_lat lat, u64 ns)
+{
+  this_cpu_inc(dev->stats->lat[lat][asgn1_hist_bucket(ns)]);
+}
+
+/**
+ * The node the next new page should be placed on, by numa_policy.
+ */
+static int asgn1_page_nid(void)
+{
+  int nid;
 
-  /* check f_pos, if beyond data_size, return 0 */
-  if (*f_pos >= asgn1_device.data_size)
+  switch (asgn1_numa)
   {
-    return 0;
+  case ASGN1_NUMA_INTERLEAVE:
+    /* racing allocators may pick the same node, which is harmless */
+    nid = next_node_in(atomic_read(&asgn1_numa_rotor), node_states[N_MEMORY]);
+    atomic_set(&asgn1_numa_rotor, nid);
+    return nid;
+  case ASGN1_NUMA_BIND:
+    return numa_node;
+  default:
+    return numa_node_id();
   }
+}
 
-  /* adjust count if reading beyond data end */
-  if (*f_pos + count > asgn1_device.data_size)
+/**
+ * Whether page placement is worth any effort: there is more than one
+ * node with memory.
+ */
+static bool asgn1_numa_spread(void)
+{
+  return num_node_state(N_MEMORY) > 1;
+}
+
+/**
+ * Count an access by this CPU to page as local or remote.
+ */
+static void asgn1_count_access(asgn1_dev *dev, struct page *page)
+{
+  asgn1_count(dev, page_to_nid(page) == numa_node_id() ? ASGN1_STAT_LOCAL
+                                                       : ASGN1_STAT_REMOTE,
+              1);
+}
+
+/**
+ * Fill pages[0..nr) with zeroed pages, taking recycled pages from the
+ * device pool first and bulk allocating the rest. The bulk allocator may
+ * stop short with memory to spare, when the per-CPU lists are contended
+ * or a zone is near its watermark, so whatever it leaves is allocated a
+ * page at a time. Returns the number of pages obtained, which is short
+ * only if a page could not be allocated at all. On a NUMA machine, pages
+ * are placed by numa_policy; only recycled pages already on the wanted
+ * node are reused, except when interleaving.
+ */
+static int asgn1_alloc_pages(asgn1_dev *dev, struct page **pages, int nr)
+{
+  bool spread = asgn1_numa_spread();
+  int nid = asgn1_page_nid();
+  struct page *page, *tmp;
+  int got = 0;
+  int i, n;
+
+  spin_lock(&dev->pool_lock);
+  list_for_each_entry_safe(page, tmp, &dev->pool, lru)
   {
-    count = asgn1_device.data_size - *f_pos;
+    if (got == nr)
+      break;
+    if (spread && asgn1_numa != ASGN1_NUMA_INTERLEAVE &&
+        page_to_nid(page) != nid)
+      continue;
+    list_del(&page->lru);
+    dev->pool_pages--;
+    pages[got++] = page;
   }
+  spin_unlock(&dev->pool_lock);
 
-  /* Traverse the list, once the first requested page is reached */
-  list_for_each_entry(curr, &asgn1_device.mem_list, list)
+  for (i = 0; i < got; i++)
   {
-    if (curr_page_no >= begin_page_no)
-    {
-      void *page_addr;
-
-      /* Calculate offset within page */
-      if (curr_page_no == begin_page_no)
-      {
-        begin_offset = *f_pos % PAGE_SIZE;
-      }
-      else
-      {
-        begin_offset = 0;
-      }
-
-      /* Calculate size to read from this page */
-      size_to_be_read = min(count - size_read, PAGE_SIZE - begin_offset);
+    clear_highpage(pages[i]);
+  }
 
-      if (size_to_be_read <= 0)
-        break;
+  memset(pages + got, 0, (nr - got) * sizeof(*pages));
 
-      /* Map page and copy to user */
-      page_addr = kmap_local_page(curr->page);
-      curr_size_read = size_to_be_read - copy_to_user(buf + size_read,
-                                                      page_addr + begin_offset,
-                                                      size_to_be_read);
-      kunmap_local(page_addr);
+  /* interleaving picks a node per page, so it skips the bulk calls */
+  while (got < nr && (!spread || asgn1_numa != ASGN1_NUMA_INTERLEAVE))
+  {
+    if (!spread || asgn1_numa == ASGN1_NUMA_LOCAL)
+      n = alloc_pages_bulk(GFP_KERNEL | __GFP_ZERO, nr - got, pages + got);
+    else
+      n = alloc_pages_bulk_node(GFP_KERNEL | __GFP_ZERO, nid, nr - got,
+                                pages + got);
+    if (n == 0)
+      break;
+    got += n;
+  }
 
-      if (curr_size_read < size_to_be_read)
-      {
-        if (size_read + curr_size_read == 0)
-        {
-          return -EINVAL; /* completely failed */
-        }
-        size_read += curr_size_read;
-        break; /* partial copy, return what we got */
-      }
+  for (; got < nr; got++)
+  {
+    pages[got] = alloc_pages_node(spread ? asgn1_page_nid() : NUMA_NO_NODE,
+                                  GFP_KERNEL | __GFP_ZERO, 0);
+    if (!pages[got])
+      break;
+  }
 
-      size_read += curr_size_read;
+  trace_asgn1_page_alloc(dev->dev, 0, nr, got);
+  asgn1_count(dev, ASGN1_STAT_ALLOCS, got);
+  if (got < nr)
+    asgn1_count(dev, ASGN1_STAT_ALLOC_FAILS, 1);
+  return got;
+}
 
-      /* if we've read everything requested, break */
-      if (size_read >= count)
-        break;
+/**
+ * Release a page the device no longer indexes. It is kept in the pool if
+ * there is room and nothing else (such as a user mapping) still holds a
+ * reference to it; otherwise our reference is simply dropped.
+ */
+static void asgn1_free_page(asgn1_dev *dev, struct page *page)
+{
+  if (page_ref_count(page) == 1)
+  {
+    set_page_private(page, 0);
+    spin_lock(&dev->pool_lock);
+    if (dev->pool_pages < dev->pool_max)
+    {
+      list_add(&page->lru, &dev->pool);
+      dev->pool_pages++;
+      page = NULL;
     }
-    curr_page_no++;
+    spin_unlock(&dev->pool_lock);
   }
 
-  *f_pos += size_read;
-  return size_read;
+  if (page)
+  {
+    __free_page(page);
+  }
 }
 
-static loff_t asgn1_lseek(struct file *, loff_t, int);
-static loff_t asgn1_lseek(struct file *file, loff_t offset, int cmd)
+/**
+ * Set the pool bound, freeing any pages above it.
+ */
+static void asgn1_set_pool_max(asgn1_dev *dev, int max)
 {
-  loff_t testpos;
+  LIST_HEAD(excess);
+  struct page *page, *tmp;
 
-  size_t buffer_size = asgn1_device.num_pages * PAGE_SIZE;
-
-  /* set testpos according to the command */
-  switch (cmd)
+  spin_lock(&dev->pool_lock);
+  dev->pool_max = max;
+  while (dev->pool_pages > max)
   {
-  case SEEK_SET:
-    testpos = offset;
-    break;
-  case SEEK_CUR:
-    testpos = file->f_pos + offset;
-    break;
-  case SEEK_END:
-    testpos = asgn1_device.data_size + offset;
-    break;
-  default:
-    return -EINVAL;
+    list_move(dev->pool.next, &excess);
+    dev->pool_pages--;
   }
+  spin_unlock(&dev->pool_lock);
 
-  /* if testpos larger than buffer_size, set testpos to buffer_size */
-  if (testpos > buffer_size)
+  list_for_each_entry_safe(page, tmp, &excess, lru)
   {
-    testpos = buffer_size;
+    list_del(&page->lru);
+    __free_page(page);
   }
+}
 
-  /* if testpos smaller than 0, set testpos to 0 */
-  if (testpos < 0)
+/**
+ * Free up to nr pages from the pool, returning how many were freed.
+ */
+static long asgn1_drain_pool(asgn1_dev *dev, long nr)
+{
+  LIST_HEAD(excess);
+  struct page *page, *tmp;
+  long drained = 0;
+
+  spin_lock(&dev->pool_lock);
+  while (drained < nr && dev->pool_pages > 0)
   {
-    testpos = 0;
+    list_move(dev->pool.next, &excess);
+    dev->pool_pages--;
+    drained++;
   }
+  spin_unlock(&dev->pool_lock);
 
-  /* set file->f_pos to testpos */
-  file->f_pos = testpos;
-
-  printk(KERN_INFO "Seeking to pos=%ld\n", (long)testpos);
-  return testpos;
+  list_for_each_entry_safe(page, tmp, &excess, lru)
+  {
+    list_del(&page->lru);
+    __free_page(page);
+  }
+  return drained;
 }
 
 /**
- * Pre-allocate pages efficiently
+ * Set up a new, resident node for page.
  */
-static int allocate_pages_to(int target_pages)
+static void asgn1_init_node(page_node *node, struct page *page)
 {
-  page_node *new_node;
-  int i;
+  node->page = page;
+  node->zdata = NULL;
+  node->zlen = 0;
+  node->atime = jiffies;
+  node->referenced = true;
+}
 
-  for (i = asgn1_device.num_pages; i < target_pages; i++)
-  {
-    if (asgn1_device.cache)
-    {
-      new_node = kmem_cache_alloc(asgn1_device.cache, GFP_KERNEL);
-    }
-    else
-    {
-      new_node = kmalloc(sizeof(page_node), GFP_KERNEL);
-    }
+/**
+ * Drop a reference to a compressed copy, freeing it with the last one.
+ */
+static void asgn1_zdata_put(asgn1_zdata *zdata)
+{
+  if (zdata && refcount_dec_and_test(&zdata->ref))
+    kfree(zdata);
+}
 
-    if (!new_node)
-      return -ENOMEM;
+/*
+ * Pages saved by sharing, over all devices: a page shared n ways saves
+ * n - 1. Sharing crosses devices, so no one device can own the figure.
+ */
+static atomic_long_t asgn1_shared_saved;
 
-    new_node->page = alloc_page(GFP_KERNEL);
-    if (!new_node->page)
-    {
-      if (asgn1_device.cache)
-      {
-        kmem_cache_free(asgn1_device.cache, new_node);
-      }
-      else
-      {
-        kfree(new_node);
-      }
-      return -ENOMEM;
-    }
+/**
+ * Count one more node sharing page.
+ */
+static void asgn1_share_get(struct page *page)
+{
+  unsigned long count = READ_ONCE(page->private);
 
-    list_add_tail(&new_node->list, &asgn1_device.mem_list);
-    asgn1_device.num_pages++;
-  }
-  return 0;
+  while (!try_cmpxchg(&page->private, &count, max(count, 1UL) + 1))
+    ;
+  atomic_long_inc(&asgn1_shared_saved);
 }
 
 /**
- * Get page by index efficiently
+ * Count one node fewer sharing page, and return whether it was shared.
  */
-static struct page *get_page_by_index(int page_index)
+static bool asgn1_share_put(struct page *page)
 {
-  page_node *curr;
-  int curr_index = 0;
+  unsigned long count = READ_ONCE(page->private);
+
+  do
+  {
+    if (count <= 1)
+      return false;
+  } while (!try_cmpxchg(&page->private, &count, count - 1));
+  atomic_long_dec(&asgn1_shared_saved);
+  return true;
+}
 
-  list_for_each_entry(curr, &asgn1_device.mem_list, list)
+static void free_page_node(asgn1_dev *dev, page_node *node)
+{
+  if (node->page)
+  {
+    asgn1_share_put(node->page);
+    asgn1_free_page(dev, node->page);
+  }
+  if (node->zdata)
   {
-    if (curr_index == page_index)
-      return curr->page;
-    curr_index++;
+    asgn1_zdata_put(node->zdata);
+    atomic_dec(&dev->zpages);
+    atomic_long_sub(node->zlen, &dev->zbytes);
   }
-  return NULL;
+  kmem_cache_free(asgn1_cache, node);
 }
 
 /**
- * This function writes from the user buffer to the virtual disk of this
- * module
+ * Count a latency sample, in nanoseconds, in hist.
  */
-ssize_t asgn1_write(struct file *, const char __user *, size_t, loff_t *);
-ssize_t asgn1_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos)
+static void asgn1_hist_add(asgn1_hist *hist, u64 ns)
 {
-  size_t orig_f_pos = *f_pos;
-  size_t size_written = 0;
-  size_t begin_offset;
-  int begin_page_no = *f_pos / PAGE_SIZE;
-  int end_page_no = (*f_pos + count - 1) / PAGE_SIZE;
-  int curr_page_no;
-  size_t curr_size_written;
-  size_t size_to_be_written;
+  atomic_long_inc(&hist->count[asgn1_hist_bucket(ns)]);
+}
+
+/**
+ * Print the non-empty buckets of a histogram, one line each.
+ */
+static void asgn1_hist_print(struct seq_file *s, const char *name,
+                             const u64 *count)
+{
+  int i;
 
-  /* Pre-allocate all needed pages at once */
-  if (end_page_no >= asgn1_device.num_pages)
+  seq_printf(s, "%s latency (ns):\n", name);
+  for (i = 0; i < ASGN1_HIST_BUCKETS; i++)
   {
-    if (allocate_pages_to(end_page_no + 1) < 0)
-    {
-      return -ENOMEM;
-    }
+    if (count[i])
+      seq_printf(s, "  >= %llu: %llu\n", 1ULL << i, count[i]);
   }
+}
+
+static void asgn1_hist_show(struct seq_file *s, const char *name,
+                            asgn1_hist *hist)
+{
+  u64 count[ASGN1_HIST_BUCKETS];
+  int i;
+
+  for (i = 0; i < ASGN1_HIST_BUCKETS; i++)
+  {
+    count[i] = atomic_long_read(&hist->count[i]);
+  }
+  asgn1_hist_print(s, name, count);
+}
+
+/**
+ * Sum the per-CPU statistics of dev into sum.
+ */
+static void asgn1_stats_sum(asgn1_dev *dev, asgn1_stats *sum)
+{
+  asgn1_stats *st;
+  int cpu, i, j;
+
+  memset(sum, 0, sizeof(*sum));
+  for_each_possible_cpu(cpu)
+  {
+    st = per_cpu_ptr(dev->stats, cpu);
+    for (i = 0; i < ASGN1_NR_STATS; i++)
+    {
+      sum->count[i] += READ_ONCE(st->count[i]);
+    }
+    for (i = 0; i < ASGN1_NR_LATS; i++)
+    {
+      for (j = 0; j < ASGN1_HIST_BUCKETS; j++)
+      {
+        sum->lat[i][j] += READ_ONCE(st->lat[i][j]);
+      }
+    }
+  }
+}
+
+/**
+ * Run one compression or decompression request on asgn1_ztfm and wait
+ * for it. On entry *dlen is the room in dst; on success it is the number
+ * of bytes produced.
+ */
+static int asgn1_zcall(bool compress, struct scatterlist *src,
+                       unsigned int slen, struct scatterlist *dst,
+                       unsigned int *dlen)
+{
+  struct acomp_req *req;
+  DECLARE_CRYPTO_WAIT(wait);
+  int err;
+
+  req = acomp_request_alloc(asgn1_ztfm);
+  if (!req)
+    return -ENOMEM;
+
+  acomp_request_set_params(req, src, dst, slen, *dlen);
+  acomp_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG, crypto_req_done,
+                             &wait);
+  err = crypto_wait_req(compress ? crypto_acomp_compress(req)
+                                 : crypto_acomp_decompress(req),
+                        &wait);
+  *dlen = req->dlen;
+  acomp_request_free(req);
+  return err;
+}
+
+/**
+ * Return the file a device restores its on-file pages from. A snapshot
+ * slot shares the file of its device, which write-behind and fsync keep
+ * writing; asgn1_preserve_snapshot() reads in what the slot still has on
+ * file before it is overwritten.
+ */
+static struct file *asgn1_backing(asgn1_dev *dev)
+{
+  return dev->origin ? dev->origin->backing : dev->backing;
+}
+
+/**
+ * Fill newpage from the compressed copy of node. The caller holds zlock.
+ */
+static int asgn1_decompress(asgn1_dev *dev, page_node *node,
+                            struct page *newpage)
+{
+  struct scatterlist src, dst;
+  unsigned int dlen = PAGE_SIZE;
+  u64 start = ktime_get_ns();
+  int err;
+
+  sg_init_one(&src, node->zdata->data, node->zlen);
+  sg_init_table(&dst, 1);
+  sg_set_page(&dst, newpage, PAGE_SIZE, 0);
+  err = asgn1_zcall(false, &src, node->zlen, &dst, &dlen);
+  if (err || dlen != PAGE_SIZE)
+    return err ? err : -EIO;
+
+  asgn1_hist_add(&dev->zlat, ktime_get_ns() - start);
+  return 0;
+}
+
+/**
+ * Fill newpage from the backing file, where page page_no follows the
+ * header page. Anything past the end of the file reads as zeros.
+ */
+static int asgn1_read_backing(asgn1_dev *dev, unsigned long page_no,
+                              struct page *newpage)
+{
+  loff_t pos = ((loff_t)page_no + 1) << PAGE_SHIFT;
+  void *addr = kmap_local_page(newpage);
+  ssize_t ret = kernel_read(asgn1_backing(dev), addr, PAGE_SIZE, &pos);
+
+  kunmap_local(addr);
+  if (ret < 0)
+    return ret;
+
+  atomic_inc(&dev->restored);
+  return 0;
+}
+
+/* eviction under a memory limit, further down */
+static int asgn1_make_room(asgn1_dev *, long);
+
+/**
+ * Bring the page at page_no back into memory, from its compressed copy or
+ * from the backing file, and return it with a reference held. Returns
+ * NULL if the page has been freed, or an ERR_PTR if it could not be read.
+ * Under a memory limit, room is made first, but a page that has to be
+ * read is loaded even if none could be found.
+ */
+static struct page *asgn1_load_page(asgn1_dev *dev, unsigned long page_no)
+{
+  struct page *page, *newpage;
+  page_node *node;
+  asgn1_zdata *zdata;
+  unsigned int zlen;
+  int err;
+
+  asgn1_make_room(dev, 1);
+  if (asgn1_alloc_pages(dev, &newpage, 1) != 1)
+    return ERR_PTR(-ENOMEM);
+
+  mutex_lock(&dev->zlock);
+  xa_lock(&dev->pages);
+  node = xa_load(&dev->pages, page_no);
+  page = node ? node->page : NULL;
+  if (page)
+    get_page(page);
+  xa_unlock(&dev->pages);
+
+  /* freed, or loaded by someone else while we waited */
+  if (!node || page)
+  {
+    mutex_unlock(&dev->zlock);
+    asgn1_free_page(dev, newpage);
+    return page;
+  }
+
+  /* holding zlock, the node and its zdata cannot go away */
+  if (node->zdata)
+    err = asgn1_decompress(dev, node, newpage);
+  else
+    err = asgn1_read_backing(dev, page_no, newpage);
+  if (err)
+  {
+    mutex_unlock(&dev->zlock);
+    asgn1_free_page(dev, newpage);
+    printk(KERN_WARNING "%s: can't load page %lu (%d)\n", MYDEV_NAME,
+           page_no, err);
+    return ERR_PTR(-EIO);
+  }
+
+  get_page(newpage); /* the caller's reference */
+  xa_lock(&dev->pages);
+  node->page = newpage;
+  zdata = node->zdata;
+  zlen = node->zlen;
+  node->zdata = NULL;
+  node->atime = jiffies;
+  node->referenced = true;
+  xa_unlock(&dev->pages);
+  mutex_unlock(&dev->zlock);
+  atomic_inc(&dev->resident);
+
+  if (zdata)
+  {
+    asgn1_zdata_put(zdata);
+    atomic_dec(&dev->zpages);
+    atomic_long_sub(zlen, &dev->zbytes);
+  }
+  return newpage;
+}
+
+/**
+ * Look up the page at page_no and take a reference to it, so it stays
+ * valid even if truncation frees its node or the compactor compresses it
+ * concurrently. A compressed or on-file page is loaded first unless
+ * resident_only is set, in which case it is skipped. Returns NULL for a
+ * hole, or an ERR_PTR if the page could not be loaded.
+ */
+static struct page *__asgn1_get_page_ref(asgn1_dev *dev,
+                                         unsigned long page_no,
+                                         bool resident_only)
+{
+  page_node *node;
+  struct page *page = NULL;
+
+  xa_lock(&dev->pages);
+  node = xa_load(&dev->pages, page_no);
+  if (node && node->page)
+  {
+    page = node->page;
+    get_page(page);
+    node->atime = jiffies;
+    node->referenced = true;
+  }
+  xa_unlock(&dev->pages);
+
+  if (node && !page && !resident_only)
+    page = asgn1_load_page(dev, page_no);
+  return page;
+}
+
+static struct page *asgn1_get_page_ref(asgn1_dev *dev, unsigned long page_no)
+{
+  return __asgn1_get_page_ref(dev, page_no, false);
+}
+
+/**
+ * Whether the page at page_no is shared, by dedup, a clone or with a
+ * snapshot, and so must be copied before it is written. The caller holds
+ * the xa_lock, or accepts a stale answer.
+ */
+static bool asgn1_page_shared(asgn1_dev *dev, unsigned long page_no,
+                              struct page *page)
+{
+  return READ_ONCE(page->private) > 1;
+}
+
+/**
+ * Give page_no a private copy of page, which it shares with other offsets
+ * or with a snapshot, and drop any user mappings of the shared page at
+ * page_no, if mapping is given. Consumes the
+ * caller's reference to page and returns the page now backing page_no
+ * with a reference held. Returns ERR_PTR(-EAGAIN) if the node changed
+ * underneath us and the lookup should be retried.
+ */
+static struct page *asgn1_unshare_page(asgn1_dev *dev,
+                                       struct address_space *mapping,
+                                       unsigned long page_no,
+                                       struct page *page)
+{
+  struct page *newpage;
+  page_node *node;
+  bool swapped = false, current_page;
+
+  if (asgn1_alloc_pages(dev, &newpage, 1) != 1)
+  {
+    put_page(page);
+    return ERR_PTR(-ENOMEM);
+  }
+  copy_highpage(newpage, page);
+
+  xa_lock(&dev->pages);
+  node = xa_load(&dev->pages, page_no);
+  current_page = node && node->page == page;
+  if (current_page && asgn1_page_shared(dev, page_no, page))
+  {
+    node->page = newpage;
+    node->atime = jiffies;
+    node->referenced = true;
+    asgn1_share_put(page);
+    swapped = true;
+  }
+  xa_unlock(&dev->pages);
+
+  if (!swapped)
+  {
+    asgn1_free_page(dev, newpage);
+    if (current_page)
+      return page; /* the other sharers went away first */
+    put_page(page);
+    return ERR_PTR(-EAGAIN);
+  }
+
+  /* drop the node's reference and ours; other sharers still hold theirs */
+  put_page(page);
+  put_page(page);
+  if (mapping)
+    unmap_mapping_range(mapping, (loff_t)page_no << PAGE_SHIFT, PAGE_SIZE, 0);
+
+  get_page(newpage);
+  return newpage;
+}
+
+/**
+ * Like asgn1_get_page_ref(), but the page returned belongs to page_no
+ * alone and may be written. The caller must keep the dedup scan away from
+ * page_no, by holding its writer stripe or dev->sem for writing.
+ */
+static struct page *asgn1_get_page_for_write(asgn1_dev *dev,
+                                             struct address_space *mapping,
+                                             unsigned long page_no)
+{
+  struct page *page;
+
+  do
+  {
+    page = asgn1_get_page_ref(dev, page_no);
+    if (IS_ERR_OR_NULL(page) || !asgn1_page_shared(dev, page_no, page))
+      return page;
+    page = asgn1_unshare_page(dev, mapping, page_no, page);
+  } while (page == ERR_PTR(-EAGAIN));
+
+  return page;
+}
+
+/**
+ * Mark the node at page_no dirty, if dev has a backing file. Returns true
+ * if it was clean before.
+ */
+static bool asgn1_set_dirty(asgn1_dev *dev, unsigned long page_no)
+{
+  bool newly = false;
+
+  if (!dev->backing || xa_get_mark(&dev->pages, page_no, ASGN1_MARK_DIRTY))
+    return false;
+
+  xa_lock(&dev->pages);
+  if (xa_load(&dev->pages, page_no) &&
+      !xa_get_mark(&dev->pages, page_no, ASGN1_MARK_DIRTY))
+  {
+    __xa_set_mark(&dev->pages, page_no, ASGN1_MARK_DIRTY);
+    newly = true;
+  }
+  xa_unlock(&dev->pages);
+
+  if (newly)
+    atomic_inc(&dev->dirty);
+  return newly;
+}
+
+/**
+ * Clear the dirty mark of the node at page_no, returning whether it was
+ * set.
+ */
+static bool asgn1_clear_dirty(asgn1_dev *dev, unsigned long page_no)
+{
+  bool was = false;
+
+  xa_lock(&dev->pages);
+  if (xa_get_mark(&dev->pages, page_no, ASGN1_MARK_DIRTY))
+  {
+    __xa_clear_mark(&dev->pages, page_no, ASGN1_MARK_DIRTY);
+    was = true;
+  }
+  xa_unlock(&dev->pages);
+
+  if (was)
+    atomic_dec(&dev->dirty);
+  return was;
+}
+
+/**
+ * Whether more than ratio percent of the pages of dev are dirty.
+ */
+static bool asgn1_over_dirty(asgn1_dev *dev, int ratio)
+{
+  return (long)atomic_read(&dev->dirty) * 100 >
+         (long)atomic_read(&dev->num_pages) * ratio;
+}
+
+/**
+ * Record that the page at page_no changed. In write-behind mode, the
+ * first page dirtied starts the clock on its write-back, and passing
+ * dirty_background_ratio starts write-back at once.
+ */
+static void asgn1_mark_dirty(asgn1_dev *dev, unsigned long page_no)
+{
+  int delay = READ_ONCE(writeback_ms);
+
+  if (!asgn1_set_dirty(dev, page_no) || delay <= 0)
+    return;
+
+  if (asgn1_over_dirty(dev, READ_ONCE(dirty_background_ratio)))
+    mod_delayed_work(asgn1_wq, &dev->flush_work, 0);
+  else
+    queue_delayed_work(asgn1_wq, &dev->flush_work, msecs_to_jiffies(delay));
+}
+
+/**
+ * Free the pages numbered first to last inclusive, and return how many
+ * there were. num_pages drops as soon as they are gone. The caller must
+ * hold dev->sem for writing.
+ */
+static int asgn1_free_range(asgn1_dev *dev, unsigned long first,
+                            unsigned long last)
+{
+  page_node *curr;
+  unsigned long index;
+  int freed = 0, resident = 0;
+
+  mutex_lock(&dev->zlock);
+  xa_for_each_range(&dev->pages, index, curr, first, last)
+  {
+    xa_lock(&dev->pages);
+    if (xa_get_mark(&dev->pages, index, ASGN1_MARK_DIRTY))
+      atomic_dec(&dev->dirty);
+    if (curr->page)
+      resident++;
+    __xa_erase(&dev->pages, index);
+    xa_unlock(&dev->pages);
+    free_page_node(dev, curr);
+    freed++;
+  }
+  mutex_unlock(&dev->zlock);
+
+  /* a racing mmap write fault may have added a page behind us, so only
+     account for what was freed */
+  atomic_sub(freed, &dev->num_pages);
+  atomic_sub(resident, &dev->resident);
+
+  /* writers polling at the page limit can write again */
+  if (freed && wq_has_sleeper(&dev->data_wait))
+    wake_up_interruptible_poll(&dev->data_wait, EPOLLOUT | EPOLLWRNORM);
+  return freed;
+}
+
+/**
+ * How many pages over its memory limit dev would be with nr more pages
+ * resident; zero or less if it would not be, or has no limit.
+ */
+static long asgn1_mem_over(asgn1_dev *dev, long nr)
+{
+  long limit = READ_ONCE(dev->mem_limit);
+
+  if (!limit)
+    return 0;
+  return atomic_read(&dev->resident) + nr - limit;
+}
+
+/**
+ * Evict up to nr resident pages of dev and return how many went. The
+ * CLOCK hand sweeps the index from where it last stopped: a page accessed
+ * since the hand last passed gets a second chance, and the next unused
+ * one goes. A clean page of a device with a backing file is dropped and
+ * read back from the file when next touched; with cache_mode, a page of a
+ * device without one is discarded and becomes a hole. Pages that are
+ * dirty, shared, mapped or in use stay. From the shrinker, reclaim is set:
+ * nothing is waited for, and the pages go back to the system rather than
+ * to the pool.
+ */
+static long asgn1_evict(asgn1_dev *dev, long nr, bool reclaim)
+{
+  bool discard = !dev->backing && READ_ONCE(cache_mode);
+  unsigned long scan = 2 * (unsigned long)atomic_read(&dev->num_pages) + 1;
+  unsigned long index;
+  struct page *page;
+  page_node *node;
+  long evicted = 0;
+
+  if ((!discard && !dev->backing) || nr <= 0)
+    return 0;
+
+  if (!reclaim)
+    mutex_lock(&dev->zlock);
+  else if (!mutex_trylock(&dev->zlock))
+    return 0;
+
+  /* holding zlock, nodes are neither freed nor loaded under us */
+  index = dev->clock_hand;
+  while (evicted < nr && scan--)
+  {
+    node = xa_find(&dev->pages, &index, ULONG_MAX, XA_PRESENT);
+    if (!node)
+    {
+      /* wrap around */
+      index = 0;
+      node = xa_find(&dev->pages, &index, ULONG_MAX, XA_PRESENT);
+      if (!node)
+        break;
+    }
+
+    page = NULL;
+    xa_lock(&dev->pages);
+    if (!node->page)
+      ; /* already out of memory */
+    else if (node->referenced)
+      node->referenced = false;
+    else if (page_ref_count(node->page) == 1 &&
+             !asgn1_page_shared(dev, index, node->page) &&
+             !xa_get_mark(&dev->pages, index, ASGN1_MARK_DIRTY))
+    {
+      page = node->page;
+      if (discard)
+        __xa_erase(&dev->pages, index);
+      else
+        node->page = NULL;
+    }
+    xa_unlock(&dev->pages);
+    index++;
+
+    if (!page)
+      continue;
+    atomic_dec(&dev->resident);
+    if (discard)
+    {
+      atomic_dec(&dev->num_pages);
+      kmem_cache_free(asgn1_cache, node);
+    }
+    if (reclaim)
+    {
+      set_page_private(page, 0);
+      __free_page(page);
+    }
+    else
+    {
+      asgn1_free_page(dev, page);
+    }
+    evicted++;
+  }
+  dev->clock_hand = index;
+  mutex_unlock(&dev->zlock);
+
+  atomic_long_add(evicted, &dev->evicted);
+  if (reclaim)
+    atomic_long_add(evicted, &dev->reclaimed);
+  return evicted;
+}
+
+/**
+ * Make room under dev's memory limit for nr more resident pages, evicting
+ * pages if need be. Returns -ENOSPC if not enough could be evicted.
+ */
+static int asgn1_make_room(asgn1_dev *dev, long nr)
+{
+  long over = asgn1_mem_over(dev, nr);
+
+  if (over <= 0)
+    return 0;
+
+  asgn1_evict(dev, over, false);
+  return asgn1_mem_over(dev, nr) > 0 ? -ENOSPC : 0;
+}
+
+/**
+ * The pages of dev the shrinker could free: the pool, plus resident pages
+ * eviction may take. Dirty pages are counted whether resident or not, so
+ * this is only an estimate.
+ */
+static unsigned long asgn1_reclaimable(asgn1_dev *dev)
+{
+  long pages = 0;
+
+  if (dev->backing)
+    pages = atomic_read(&dev->resident) - atomic_read(&dev->dirty);
+  else if (READ_ONCE(cache_mode))
+    pages = atomic_read(&dev->resident);
+
+  return READ_ONCE(dev->pool_pages) + max(pages, 0L);
+}
+
+static unsigned long asgn1_shrink_count(struct shrinker *shrinker,
+                                        struct shrink_control *sc)
+{
+  unsigned long count = 0;
+  int i;
+
+  for (i = 0; i < asgn1_nr_devs; i++)
+  {
+    count += asgn1_reclaimable(&asgn1_devices[i]);
+  }
+  return count ? count : SHRINK_EMPTY;
+}
+
+/**
+ * Free pages under memory pressure, emptying the pools before evicting.
+ */
+static unsigned long asgn1_shrink_scan(struct shrinker *shrinker,
+                                       struct shrink_control *sc)
+{
+  unsigned long freed = 0;
+  asgn1_dev *dev;
+  int i;
+
+  for (i = 0; i < asgn1_nr_devs && freed < sc->nr_to_scan; i++)
+  {
+    dev = &asgn1_devices[i];
+    freed += asgn1_drain_pool(dev, sc->nr_to_scan - freed);
+    if (freed < sc->nr_to_scan)
+      freed += asgn1_evict(dev, sc->nr_to_scan - freed, true);
+  }
+  return freed ? freed : SHRINK_STOP;
+}
+
+/**
+ * Zero len bytes at pos, which must lie within one page. Holes are
+ * already zero, and a shared page is copied first. The caller must hold
+ * dev->sem for writing.
+ */
+static void asgn1_zero_partial(asgn1_dev *dev, struct address_space *mapping,
+                               loff_t pos, size_t len)
+{
+  struct page *page;
+
+  if (!len)
+    return;
+
+  page = asgn1_get_page_for_write(dev, mapping, pos >> PAGE_SHIFT);
+  if (!IS_ERR_OR_NULL(page))
+  {
+    zero_user(page, offset_in_page(pos), len);
+    asgn1_mark_dirty(dev, pos >> PAGE_SHIFT);
+    put_page(page);
+  }
+}
+
+/* the backing file, further down */
+static void asgn1_discard_backing(asgn1_dev *, unsigned long, unsigned long);
+
+/**
+ * This function frees all memory pages held by the device and returns
+ * how many there were. The caller must hold dev->sem for writing.
+ */
+int free_memory_pages(asgn1_dev *);
+int free_memory_pages(asgn1_dev *dev)
+{
+  int freed;
+
+  /* Free the entire page index and reset device data size */
+  freed = asgn1_free_range(dev, 0, ULONG_MAX);
+  atomic_long_set(&dev->data_size, 0);
+  return freed;
+}
+
+/**
+ * A blocking open waiting for the device to admit it.
+ */
+struct asgn1_opener
+{
+  struct list_head link;  /* in asgn1_dev.open_queue, oldest first */
+  bool admitted;          /* given a slot by asgn1_admit_queued() */
+};
+
+/**
+ * Give free slots to queued openers in the order they arrived. Returns
+ * whether any were admitted and need waking. The caller holds open_lock.
+ */
+static bool asgn1_admit_queued(asgn1_dev *dev)
+{
+  struct asgn1_opener *opener;
+  bool admitted = false;
+
+  while (!list_empty(&dev->open_queue) &&
+         atomic_read(&dev->nprocs) < atomic_read(&dev->max_nprocs))
+  {
+    opener = list_first_entry(&dev->open_queue, struct asgn1_opener, link);
+    list_del_init(&opener->link);
+    atomic_inc(&dev->nprocs);
+    WRITE_ONCE(opener->admitted, true);
+    admitted = true;
+  }
+  return admitted;
+}
+
+/**
+ * Give back a slot taken by asgn1_get_slot(), to the oldest queued opener
+ * if there is one.
+ */
+static void asgn1_put_slot(asgn1_dev *dev)
+{
+  bool woke;
+
+  spin_lock(&dev->open_lock);
+  atomic_dec(&dev->nprocs);
+  woke = asgn1_admit_queued(dev);
+  spin_unlock(&dev->open_lock);
+
+  if (woke)
+    wake_up_all(&dev->open_wait);
+}
+
+/**
+ * Take one of the max_nprocs slots of dev. With nonblock, fail with
+ * -EBUSY if none is free; otherwise queue behind earlier openers and
+ * sleep until asgn1_put_slot() hands us one, so a newcomer can't take a
+ * slot a queued opener is waiting for.
+ */
+static int asgn1_get_slot(asgn1_dev *dev, bool nonblock)
+{
+  struct asgn1_opener me = {.admitted = false};
+  bool admitted;
+  int err;
+
+  spin_lock(&dev->open_lock);
+  if (list_empty(&dev->open_queue) &&
+      atomic_read(&dev->nprocs) < atomic_read(&dev->max_nprocs))
+  {
+    atomic_inc(&dev->nprocs);
+    spin_unlock(&dev->open_lock);
+    return 0;
+  }
+  if (nonblock)
+  {
+    spin_unlock(&dev->open_lock);
+    asgn1_count(dev, ASGN1_STAT_BUSY, 1);
+    return -EBUSY;
+  }
+  list_add_tail(&me.link, &dev->open_queue);
+  spin_unlock(&dev->open_lock);
+
+  err = wait_event_interruptible(dev->open_wait, READ_ONCE(me.admitted));
+  if (!err)
+    return 0;
+
+  /* interrupted; a slot given to us meanwhile goes to the next in line */
+  spin_lock(&dev->open_lock);
+  admitted = me.admitted;
+  if (!admitted)
+    list_del(&me.link);
+  spin_unlock(&dev->open_lock);
+  if (admitted)
+    asgn1_put_slot(dev);
+  return err;
+}
+
+/**
+ * This function opens the virtual disk, if it is opened in the write-only
+ * mode, all memory pages will be freed. When max_nprocs processes have
+ * it open, a blocking open waits its turn and an O_NONBLOCK open fails
+ * with -EBUSY.
+ */
+static int asgn1_do_open(struct inode *, struct file *);
+static int asgn1_do_open(struct inode *inode, struct file *filp)
+{
+  asgn1_dev *dev = container_of(inode->i_cdev, asgn1_dev, cdev);
+  loff_t size;
+  int err, freed;
+
+  filp->private_data = dev;
+
+  if (dev->readonly && (filp->f_mode & FMODE_WRITE))
+  {
+    return -EROFS;
+  }
+
+  /* take a process slot, waiting for one unless O_NONBLOCK */
+  err = asgn1_get_slot(dev, filp->f_flags & O_NONBLOCK);
+  if (err)
+  {
+    return err;
+  }
+
+  /* a ring is a stream; nothing is freed at open */
+  if (dev->ring)
+  {
+    return stream_open(inode, filp);
+  }
+
+  /* if opened in write-only mode, free all memory pages, unless to
+     append to them */
+  if ((filp->f_flags & O_ACCMODE) == O_WRONLY && !(filp->f_flags & O_APPEND))
+  {
+    down_write(&dev->sem);
+    size = atomic_long_read(&dev->data_size);
+    freed = free_memory_pages(dev);
+    trace_asgn1_truncate(dev->dev, 0, size, freed);
+    asgn1_discard_backing(dev, 0, ULONG_MAX);
+    up_write(&dev->sem);
+
+    /* drop user mappings of the freed pages; they are refcounted, so
+       existing mappings were never left pointing at freed memory */
+    unmap_mapping_range(filp->f_mapping, 0, 0, 1);
+  }
+
+  return 0; /* success */
+}
+
+int asgn1_open(struct inode *, struct file *);
+int asgn1_open(struct inode *inode, struct file *filp)
+{
+  asgn1_dev *dev = container_of(inode->i_cdev, asgn1_dev, cdev);
+  int ret = asgn1_do_open(inode, filp);
+
+  trace_asgn1_open(dev->dev, filp->f_flags, atomic_read(&dev->nprocs), ret);
+  return ret;
+}
+
+/**
+ * This function releases the virtual disk, but nothing needs to be done
+ * in this case.
+ */
+int asgn1_release(struct inode *, struct file *);
+int asgn1_release(struct inode *inode, struct file *filp)
+{
+  asgn1_dev *dev = filp->private_data;
+
+  /* decrement process count, admitting the next waiting open */
+  asgn1_put_slot(dev);
+  trace_asgn1_release(dev->dev, atomic_read(&dev->nprocs));
+  return 0;
+}
+
+/**
+ * Copy len bytes between iter and the ring of dev, starting at ring
+ * position pos, wrapping at the end of the ring. Returns the bytes
+ * copied, which is short only if iter faulted.
+ */
+static size_t asgn1_ring_copy(asgn1_dev *dev, u64 pos, size_t len,
+                              struct iov_iter *iter, bool write)
+{
+  size_t done = 0, off, n, copied;
+  struct page *page;
+  u64 at;
+
+  while (done < len)
+  {
+    at = (pos + done) & (dev->ring_size - 1);
+    page = dev->ring[at >> PAGE_SHIFT];
+    off = offset_in_page(at);
+    n = min(len - done, PAGE_SIZE - off);
+    if (write)
+      copied = copy_page_from_iter(page, off, n, iter);
+    else
+      copied = copy_page_to_iter(page, off, n, iter);
+    done += copied;
+    if (copied < n)
+      break;
+  }
+  return done;
+}
+
+/**
+ * Whether the ring of dev holds data.
+ */
+static bool asgn1_ring_ready(asgn1_dev *dev)
+{
+  return READ_ONCE(dev->ring_ctl->tail) !=
+         smp_load_acquire(&dev->ring_ctl->head);
+}
+
+/**
+ * Add delta to the count of consumers sleeping on the ring. Consumers in
+ * userspace update it too, so it is only changed by compare-and-swap,
+ * which also orders it against the following load of head.
+ */
+static void asgn1_ring_waiters(struct asgn1_ring_ctl *ctl, int delta)
+{
+  u32 waiting = READ_ONCE(ctl->waiting);
+
+  while (!try_cmpxchg(&ctl->waiting, &waiting, waiting + delta))
+    ;
+}
+
+/**
+ * Wake the consumers that said they sleep, after head has been stored.
+ */
+static void asgn1_ring_kick(asgn1_dev *dev)
+{
+  smp_mb(); /* store head before loading waiting; pairs with the reader */
+  if (READ_ONCE(dev->ring_ctl->waiting))
+    wake_up_interruptible_poll(&dev->data_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/**
+ * Consume from the ring, as the consumer in struct asgn1_ring_ctl does,
+ * sleeping while it is empty unless the file is non-blocking. The indexes
+ * live in a page userspace can write, so they are never trusted for more
+ * than the ring size.
+ */
+static ssize_t asgn1_ring_read(struct kiocb *iocb, struct iov_iter *to)
+{
+  asgn1_dev *dev = iocb->ki_filp->private_data;
+  struct asgn1_ring_ctl *ctl = dev->ring_ctl;
+  size_t count = iov_iter_count(to);
+  size_t copied;
+  u64 head, tail;
+  int err;
+
+  if (count == 0)
+    return 0;
+
+  for (;;)
+  {
+    tail = READ_ONCE(ctl->tail);
+    head = smp_load_acquire(&ctl->head);
+    if (head == tail)
+    {
+      if ((iocb->ki_flags & IOCB_NOWAIT) ||
+          (iocb->ki_filp->f_flags & O_NONBLOCK))
+        return -EAGAIN;
+
+      asgn1_ring_waiters(ctl, 1);
+      err = wait_event_interruptible(dev->data_wait, asgn1_ring_ready(dev));
+      asgn1_ring_waiters(ctl, -1);
+      if (err)
+        return err;
+      continue;
+    }
+
+    copied = asgn1_ring_copy(dev, tail, min3((u64)count, head - tail,
+                                              (u64)dev->ring_size),
+                             to, false);
+    if (try_cmpxchg64(&ctl->tail, &tail, tail + copied))
+      return copied ? copied : -EFAULT;
+
+    /* overwritten while we copied it */
+    iov_iter_revert(to, copied);
+  }
+}
+
+/**
+ * Produce into the ring, overwriting the oldest data if it is full. At
+ * most one ring's worth of the buffer is taken. Writers take ring_lock,
+ * so write() is a single producer however many threads call it.
+ */
+static ssize_t asgn1_ring_write(struct kiocb *iocb, struct iov_iter *from)
+{
+  asgn1_dev *dev = iocb->ki_filp->private_data;
+  struct asgn1_ring_ctl *ctl = dev->ring_ctl;
+  size_t count = min(iov_iter_count(from), dev->ring_size);
+  size_t done;
+  u64 head, tail;
+
+  if (count == 0)
+    return 0;
+
+  mutex_lock(&dev->ring_lock);
+  head = READ_ONCE(ctl->head);
+  tail = READ_ONCE(ctl->tail);
+  while (head + count - tail > dev->ring_size &&
+         !try_cmpxchg64(&ctl->tail, &tail, head + count - dev->ring_size))
+    ;
+  done = asgn1_ring_copy(dev, head, count, from, true);
+  smp_store_release(&ctl->head, head + done);
+  mutex_unlock(&dev->ring_lock);
+
+  if (done == 0)
+    return -EFAULT;
+  asgn1_ring_kick(dev);
+  return done;
+}
+
+/**
+ * Map the control page at page 0 of the ring and the data after it.
+ */
+static vm_fault_t asgn1_ring_fault(struct vm_fault *vmf)
+{
+  asgn1_dev *dev = vmf->vma->vm_private_data;
+  struct page *page;
+
+  if (vmf->pgoff == 0)
+    page = virt_to_page(dev->ring_ctl);
+  else if (vmf->pgoff <= dev->ring_size >> PAGE_SHIFT)
+    page = dev->ring[vmf->pgoff - 1];
+  else
+    return VM_FAULT_SIGBUS;
+
+  get_page(page);
+  vmf->page = page;
+  return 0;
+}
+
+static const struct vm_operations_struct asgn1_ring_vm_ops = {
+    .fault = asgn1_ring_fault,
+};
+
+/**
+ * Set up a mapping of a ring device. It may not extend past the ring,
+ * which never grows.
+ */
+static int asgn1_ring_mmap(asgn1_dev *dev, struct vm_area_struct *vma)
+{
+  if (vma->vm_pgoff + vma_pages(vma) > 1 + (dev->ring_size >> PAGE_SHIFT))
+    return -EINVAL;
+
+  vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+  vma->vm_ops = &asgn1_ring_vm_ops;
+  vma->vm_private_data = dev;
+  return 0;
+}
+
+/**
+ * Make dev a ring of kb KiB, rounded up to a power of two pages. The ring
+ * is allocated whole and kept out of the page index, so eviction,
+ * compression and dedup leave it alone.
+ */
+static int asgn1_ring_setup(asgn1_dev *dev, int kb)
+{
+  unsigned long nr = roundup_pow_of_two(DIV_ROUND_UP((size_t)kb << 10,
+                                                     PAGE_SIZE));
+  int got;
+
+  dev->ring_ctl = (void *)get_zeroed_page(GFP_KERNEL);
+  dev->ring = kvcalloc(nr, sizeof(*dev->ring), GFP_KERNEL);
+  if (!dev->ring_ctl || !dev->ring)
+    goto fail;
+
+  got = asgn1_alloc_pages(dev, dev->ring, nr);
+  if (got < nr)
+  {
+    while (got > 0)
+      asgn1_free_page(dev, dev->ring[--got]);
+    goto fail;
+  }
+
+  mutex_init(&dev->ring_lock);
+  dev->ring_size = nr << PAGE_SHIFT;
+  dev->ring_ctl->size = dev->ring_size;
+  return 0;
+
+fail:
+  kvfree(dev->ring);
+  dev->ring = NULL;
+  free_page((unsigned long)dev->ring_ctl);
+  dev->ring_ctl = NULL;
+  return -ENOMEM;
+}
+
+/**
+ * Free the ring of dev, if it is one.
+ */
+static void asgn1_ring_teardown(asgn1_dev *dev)
+{
+  unsigned long i;
+
+  if (!dev->ring)
+    return;
+
+  for (i = 0; i < dev->ring_size >> PAGE_SHIFT; i++)
+  {
+    asgn1_free_page(dev, dev->ring[i]);
+  }
+  kvfree(dev->ring);
+  dev->ring = NULL;
+  free_page((unsigned long)dev->ring_ctl);
+  dev->ring_ctl = NULL;
+}
+
+/**
+ * Copy count bytes at pos out of the page store into to, whatever the
+ * data size. Shared by read() and the block device. The caller holds
+ * dev->sem shared. Returns the bytes copied, or an error if there were
+ * none.
+ */
+static ssize_t asgn1_read_pages(asgn1_dev *dev, loff_t pos, size_t count,
+                                struct iov_iter *to)
+{
+  size_t size_read = 0;                   /* size read from virtual disk in this function */
+  size_t begin_offset;                    /* the offset from the beginning of a page to
+                           start reading */
+  int curr_page_no;                       /* the current page number */
+  size_t curr_size_read;                  /* size read from the virtual disk in this round */
+  size_t size_to_be_read;                 /* size to be read in the current round */
+
+  struct page *page;
+  ssize_t err = -EINVAL;
+
+  /* Look up each requested page directly in the page index; pages that
+     were never written are holes and read back as zeros */
+  for (curr_page_no = pos / PAGE_SIZE; size_read < count; curr_page_no++)
+  {
+    begin_offset = (pos + size_read) % PAGE_SIZE;
+    size_to_be_read = min(count - size_read, PAGE_SIZE - begin_offset);
+
+    page = asgn1_get_page_ref(dev, curr_page_no);
+    if (IS_ERR(page))
+    {
+      err = PTR_ERR(page);
+      break;
+    }
+    if (page)
+    {
+      curr_size_read = copy_page_to_iter(page, begin_offset,
+                                         size_to_be_read, to);
+      asgn1_count_access(dev, page);
+      put_page(page);
+    }
+    else
+    {
+      curr_size_read = iov_iter_zero(size_to_be_read, to);
+    }
+    size_read += curr_size_read;
+
+    if (curr_size_read < size_to_be_read)
+      break; /* partial copy, return what we got */
+  }
+
+  if (size_read == 0 && count > 0)
+    return err; /* completely failed */
+  return size_read;
+}
+
+/**
+ * This function reads contents of the virtual disk into the caller's
+ * iov_iter. A single pass copies across pages and user segments, so
+ * readv() and io_uring reads cost one call rather than one per segment.
+ */
+static ssize_t asgn1_do_read(struct kiocb *, struct iov_iter *);
+static ssize_t asgn1_do_read(struct kiocb *iocb, struct iov_iter *to)
+{
+  asgn1_dev *dev = iocb->ki_filp->private_data;
+  loff_t pos = iocb->ki_pos;              /* where this read starts */
+  size_t count = iov_iter_count(to);      /* size requested */
+  size_t data_size;
+  ssize_t ret;
+
+  if (dev->ring)
+    return asgn1_ring_read(iocb, to);
+
+  down_read(&dev->sem);
+  data_size = atomic_long_read(&dev->data_size);
+
+  /* check pos, if beyond data_size, return 0 */
+  if (pos >= data_size)
+  {
+    up_read(&dev->sem);
+    return 0;
+  }
+
+  /* adjust count if reading beyond data end */
+  if (pos + count > data_size)
+  {
+    count = data_size - pos;
+  }
+
+  ret = asgn1_read_pages(dev, pos, count, to);
+  up_read(&dev->sem);
+
+  if (ret > 0)
+    iocb->ki_pos += ret;
+  return ret;
+}
+
+/**
+ * Read, counting the call, the bytes read and its latency.
+ */
+ssize_t asgn1_read_iter(struct kiocb *, struct iov_iter *);
+ssize_t asgn1_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+  asgn1_dev *dev = iocb->ki_filp->private_data;
+  loff_t pos = iocb->ki_pos;
+  size_t len = iov_iter_count(to);
+  u64 start = ktime_get_ns();
+  ssize_t ret = asgn1_do_read(iocb, to);
+  u64 ns = ktime_get_ns() - start;
+
+  asgn1_count(dev, ASGN1_STAT_READS, 1);
+  if (ret > 0)
+    asgn1_count(dev, ASGN1_STAT_READ_BYTES, ret);
+  asgn1_time(dev, ASGN1_LAT_READ, ns);
+  trace_asgn1_read(dev->dev, pos, len, ret, ns);
+  return ret;
+}
+
+/* device pages lent to a pipe; the pipe holds a reference to each */
+static const struct pipe_buf_operations asgn1_pipe_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get = generic_pipe_buf_get,
+};
+
+static void asgn1_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+  put_page(spd->pages[i]);
+}
+
+/**
+ * Fill spd with references to the pages holding len bytes at pos, holes
+ * being the zero page, and return the bytes covered. The caller holds
+ * dev->sem shared.
+ */
+static ssize_t asgn1_splice_pages(asgn1_dev *dev, loff_t pos, size_t len,
+                                  struct splice_pipe_desc *spd)
+{
+  size_t done = 0, offset, chunk;
+  struct page *page;
+
+  spd->nr_pages = 0;
+  while (done < len && spd->nr_pages < spd->nr_pages_max)
+  {
+    offset = offset_in_page(pos + done);
+    chunk = min(len - done, PAGE_SIZE - offset);
+
+    page = asgn1_get_page_ref(dev, (pos + done) >> PAGE_SHIFT);
+    if (IS_ERR(page))
+      return done ? done : PTR_ERR(page);
+    if (!page)
+    {
+      page = ZERO_PAGE(0);
+      get_page(page);
+    }
+
+    spd->pages[spd->nr_pages] = page;
+    spd->partial[spd->nr_pages].offset = offset;
+    spd->partial[spd->nr_pages].len = chunk;
+    spd->nr_pages++;
+    done += chunk;
+  }
+  return done;
+}
+
+/**
+ * Move data to a pipe without copying it: the pipe is handed references
+ * to the device pages themselves, PIPE_DEF_BUFFERS at a time until the
+ * pipe is full. As with a file's page cache, data changed on the device
+ * before it is read from the pipe is read as changed. Spliced reads are
+ * counted and traced as reads.
+ */
+static ssize_t asgn1_splice_read(struct file *, loff_t *,
+                                 struct pipe_inode_info *, size_t,
+                                 unsigned int);
+static ssize_t asgn1_splice_read(struct file *in, loff_t *ppos,
+                                 struct pipe_inode_info *pipe, size_t len,
+                                 unsigned int flags)
+{
+  asgn1_dev *dev = in->private_data;
+  struct page *pages[PIPE_DEF_BUFFERS];
+  struct partial_page partial[PIPE_DEF_BUFFERS];
+  struct splice_pipe_desc spd = {
+      .pages = pages,
+      .partial = partial,
+      .nr_pages_max = PIPE_DEF_BUFFERS,
+      .ops = &asgn1_pipe_buf_ops,
+      .spd_release = asgn1_spd_release,
+  };
+  loff_t pos = *ppos;
+  size_t want = len, data_size;
+  u64 start = ktime_get_ns(), ns;
+  ssize_t total = 0, got, moved = 0;
+
+  /* ring data is consumed as it is read, so it can't be lent out */
+  if (dev->ring)
+    return copy_splice_read(in, ppos, pipe, len, flags);
+
+  while (len > 0)
+  {
+    down_read(&dev->sem);
+    data_size = atomic_long_read(&dev->data_size);
+    if (pos + total >= data_size)
+    {
+      up_read(&dev->sem);
+      break;
+    }
+    got = asgn1_splice_pages(dev, pos + total,
+                             min_t(size_t, len, data_size - pos - total), &spd);
+    up_read(&dev->sem);
+    if (got <= 0)
+    {
+      moved = got;
+      break;
+    }
+
+    /* the pipe is locked by our caller, and takes over our references */
+    moved = splice_to_pipe(pipe, &spd);
+    if (moved <= 0)
+      break;
+    total += moved;
+    len -= moved;
+    if (moved < got)
+      break; /* the pipe is full */
+  }
+
+  if (total)
+  {
+    *ppos = pos + total;
+    moved = total;
+  }
+
+  ns = ktime_get_ns() - start;
+  asgn1_count(dev, ASGN1_STAT_READS, 1);
+  if (total)
+    asgn1_count(dev, ASGN1_STAT_READ_BYTES, total);
+  asgn1_time(dev, ASGN1_LAT_READ, ns);
+  trace_asgn1_read(dev->dev, pos, want, moved, ns);
+  return moved;
+}
+
+/**
+ * Find the first byte at or after pos that is backed by a page (data) or
+ * not (hole), limited to the data written so far. Pages are only looked
+ * at through the index, so runs of holes are skipped in one step.
+ */
+static loff_t asgn1_seek_data_hole(asgn1_dev *dev, loff_t pos, int whence)
+{
+  loff_t data_size = atomic_long_read(&dev->data_size);
+  unsigned long index = pos >> PAGE_SHIFT;
+  XA_STATE(xas, &dev->pages, index);
+  void *entry;
+
+  if (pos >= data_size)
+    return -ENXIO;
+
+  if (whence == SEEK_DATA)
+  {
+    if (!xa_find(&dev->pages, &index, ULONG_MAX, XA_PRESENT))
+      return -ENXIO;
+    pos = max_t(loff_t, pos, (loff_t)index << PAGE_SHIFT);
+    return pos < data_size ? pos : -ENXIO;
+  }
+
+  /* SEEK_HOLE: walk the run of present pages starting at index */
+  rcu_read_lock();
+  xas_for_each(&xas, entry, ULONG_MAX)
+  {
+    if (xas_retry(&xas, entry))
+      continue;
+    if (xas.xa_index != index)
+      break;
+    index++;
+  }
+  rcu_read_unlock();
+
+  pos = max_t(loff_t, pos, (loff_t)index << PAGE_SHIFT);
+  return min(pos, data_size);
+}
+
+static loff_t asgn1_do_lseek(struct file *, loff_t, int);
+static loff_t asgn1_do_lseek(struct file *file, loff_t offset, int cmd)
+{
+  asgn1_dev *dev = file->private_data;
+  loff_t testpos;
+
+  /* set testpos according to the command */
+  switch (cmd)
+  {
+  case SEEK_SET:
+    testpos = offset;
+    break;
+  case SEEK_CUR:
+    testpos = file->f_pos + offset;
+    break;
+  case SEEK_END:
+    testpos = atomic_long_read(&dev->data_size) + offset;
+    break;
+  case SEEK_DATA:
+  case SEEK_HOLE:
+    if (offset < 0)
+      return -ENXIO;
+    testpos = asgn1_seek_data_hole(dev, offset, cmd);
+    if (testpos < 0)
+      return testpos;
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  /* the device is sparse, so any position up to the largest device size
+     is valid; writes there leave a hole in front of them */
+  if (testpos > ASGN1_MAX_BYTES)
+  {
+    testpos = ASGN1_MAX_BYTES;
+  }
+
+  /* if testpos smaller than 0, set testpos to 0 */
+  if (testpos < 0)
+  {
+    testpos = 0;
+  }
+
+  /* set file->f_pos to testpos */
+  file->f_pos = testpos;
+  return testpos;
+}
+
+static loff_t asgn1_lseek(struct file *, loff_t, int);
+static loff_t asgn1_lseek(struct file *file, loff_t offset, int cmd)
+{
+  asgn1_dev *dev = file->private_data;
+  loff_t ret = asgn1_do_lseek(file, offset, cmd);
+
+  trace_asgn1_lseek(dev->dev, offset, cmd, ret);
+  return ret;
+}
+
+/**
+ * Whether page number first starts an extent that extent mode can back
+ * in one allocation: it must be aligned, fit under the page limit, and
+ * have no pages in it yet.
+ */
+static bool asgn1_extent_fits(asgn1_dev *dev, int first)
+{
+  int nr = 1 << extent_order;
+  unsigned long index = first;
+
+  if (first % nr)
+    return false;
+  if (dev->max_pages && atomic_read(&dev->num_pages) + nr > dev->max_pages)
+    return false;
+
+  return !xa_find(&dev->pages, &index, first + nr - 1, XA_PRESENT);
+}
+
+/**
+ * Back the extent starting at page number first with one 2^extent_order
+ * allocation, split into order-0 pages so each can be indexed, mapped and
+ * freed on its own while staying physically contiguous. Returns the
+ * number of pages covered, 0 if no extent was available and the caller
+ * should fall back to single pages, or a negative errno.
+ */
+static int asgn1_alloc_extent(asgn1_dev *dev, int first)
+{
+  int nr = 1 << extent_order;
+  struct page *page;
+  page_node *node, *old;
+  int k, err;
+
+  err = asgn1_make_room(dev, nr);
+  if (err)
+    return err;
+
+  page = alloc_pages_node(asgn1_page_nid(),
+                          GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY,
+                          extent_order);
+  trace_asgn1_page_alloc(dev->dev, extent_order, 1, page ? 1 : 0);
+  if (!page)
+  {
+    atomic_inc(&dev->extent_fallbacks);
+    return 0;
+  }
+  split_page(page, extent_order);
+  atomic_inc(&dev->extents);
+  asgn1_count(dev, ASGN1_STAT_ALLOCS, nr);
+
+  for (k = 0; k < nr; k++)
+  {
+    node = kmem_cache_alloc_node(asgn1_cache, GFP_KERNEL, page_to_nid(page));
+    if (!node)
+    {
+      /* drop the rest of the extent */
+      for (; k < nr; k++)
+      {
+        __free_page(page + k);
+      }
+      return -ENOMEM;
+    }
+    asgn1_init_node(node, page + k);
+
+    old = xa_cmpxchg(&dev->pages, first + k, NULL, node, GFP_KERNEL);
+    if (old)
+    {
+      /* lost the race to another writer, or the store failed */
+      free_page_node(dev, node);
+      if (xa_is_err(old))
+      {
+        for (k++; k < nr; k++)
+        {
+          __free_page(page + k);
+        }
+        return xa_err(old);
+      }
+      continue;
+    }
+    atomic_inc(&dev->num_pages);
+    atomic_inc(&dev->resident);
+    asgn1_set_dirty(dev, first + k);
+  }
+  return nr;
+}
+
+/**
+ * Allocate a page_node for each of pages[0..nr), in one bulk call unless
+ * pages are being spread over NUMA nodes, in which case each node goes on
+ * the node of its page. Returns false, having freed any allocated, if
+ * they could not all be allocated.
+ */
+static bool asgn1_alloc_nodes(page_node **nodes, struct page **pages, int nr)
+{
+  int i;
+
+  if (!asgn1_numa_spread() || asgn1_numa == ASGN1_NUMA_LOCAL)
+    return kmem_cache_alloc_bulk(asgn1_cache, GFP_KERNEL, nr, (void **)nodes);
+
+  for (i = 0; i < nr; i++)
+  {
+    nodes[i] = kmem_cache_alloc_node(asgn1_cache, GFP_KERNEL,
+                                     pages[i] ? page_to_nid(pages[i])
+                                              : NUMA_NO_NODE);
+    if (!nodes[i])
+    {
+      kmem_cache_free_bulk(asgn1_cache, i, (void **)nodes);
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Allocate the missing pages in [first, end). Only the pages in the range
+ * are allocated, so a write far beyond the end of the device leaves a
+ * hole in front of it instead of filling the gap. In extent mode, each
+ * empty aligned extent the range touches is backed by one higher-order
+ * allocation. Other missing pages are gathered in batches of
+ * ASGN1_ALLOC_BATCH, whose page_nodes come from one bulk slab call and
+ * whose pages come from the pool or the bulk page allocator.
+ *
+ * Safe against concurrent callers and readers: each page is published
+ * with xa_cmpxchg(), and a caller that loses the race for a page frees
+ * its copy and moves on. The caller should hold dev->sem (shared is
+ * enough); the mmap fault path cannot, and a fault racing with
+ * truncation may leave a stray page, which is accounted for normally.
+ * A hole read through mapping may have the zero page mapped over it;
+ * that is unmapped once the hole is filled.
+ */
+static int allocate_pages_range(asgn1_dev *dev, struct address_space *mapping,
+                                int first, int end)
+{
+  page_node *nodes[ASGN1_ALLOC_BATCH];
+  struct page *pages[ASGN1_ALLOC_BATCH];
+  int want[ASGN1_ALLOC_BATCH];
+  int extent_pages = 1 << extent_order;
+  page_node *old;
+  int nr, got, i, j, limit, base;
+  int err = 0;
+
+  i = first;
+  while (i < end && !err)
+  {
+    limit = end;
+    if (extent_order)
+    {
+      base = i & ~(extent_pages - 1);
+      if (!xa_load(&dev->pages, i) && asgn1_extent_fits(dev, base))
+      {
+        got = asgn1_alloc_extent(dev, base);
+        if (got < 0)
+          return got;
+        if (got > 0)
+        {
+          if (mapping && mapping_mapped(mapping))
+            unmap_mapping_range(mapping, (loff_t)base << PAGE_SHIFT,
+                                (loff_t)got << PAGE_SHIFT, 0);
+          i = base + got;
+          continue;
+        }
+      }
+      /* give the next extent its own chance at a higher-order page */
+      limit = min(end, base + extent_pages);
+    }
+
+    /* collect the next batch of missing page numbers */
+    for (nr = 0; i < limit && nr < ASGN1_ALLOC_BATCH; i++)
+    {
+      if (!xa_load(&dev->pages, i))
+        want[nr++] = i;
+    }
+    if (nr == 0)
+      continue;
+
+    if (dev->max_pages && atomic_read(&dev->num_pages) + nr > dev->max_pages)
+      return -ENOSPC;
+
+    err = asgn1_make_room(dev, nr);
+    if (err)
+      return err;
+
+    got = asgn1_alloc_pages(dev, pages, nr);
+    if (!asgn1_alloc_nodes(nodes, pages, nr))
+    {
+      for (j = 0; j < got; j++)
+      {
+        asgn1_free_page(dev, pages[j]);
+      }
+      asgn1_count(dev, ASGN1_STAT_ALLOC_FAILS, 1);
+      return -ENOMEM;
+    }
+
+    for (j = 0; j < nr; j++)
+    {
+      asgn1_init_node(nodes[j], j < got ? pages[j] : NULL);
+      if (!nodes[j]->page && !err)
+        err = -ENOMEM;
+
+      /* after a failure, free the rest of the batch */
+      if (err)
+      {
+        free_page_node(dev, nodes[j]);
+        continue;
+      }
+
+      old = xa_cmpxchg(&dev->pages, want[j], NULL, nodes[j], GFP_KERNEL);
+      if (old)
+      {
+        /* lost the race to another writer, or the store failed */
+        free_page_node(dev, nodes[j]);
+        if (xa_is_err(old))
+          err = xa_err(old);
+        continue;
+      }
+      atomic_inc(&dev->num_pages);
+      atomic_inc(&dev->resident);
+      asgn1_set_dirty(dev, want[j]);
+      if (mapping && mapping_mapped(mapping))
+        unmap_mapping_range(mapping, (loff_t)want[j] << PAGE_SHIFT,
+                            PAGE_SIZE, 0);
+    }
+  }
+  return err;
+}
+
+/* write-back to the backing file, further down */
+static int asgn1_flush(asgn1_dev *, long);
+static int asgn1_fsync(struct file *, loff_t, loff_t, int);
+
+/**
+ * This function writes from the caller's iov_iter to the virtual disk of
+ * this module, at *ppos, or with append at the end of the data, when
+ * *ppos is set to where the data went. Each page is filled under its
+ * writer stripe, so concurrent writers to different pages do not
+ * serialise. Shared by write() and the block device; mapping is where
+ * shared pages copied for the write are unmapped from, and may be NULL.
+ * Returns the bytes written, or an error if there were none.
+ */
+static ssize_t asgn1_write_pages(asgn1_dev *dev, struct address_space *mapping,
+                                 loff_t *ppos, struct iov_iter *from,
+                                 bool append)
+{
+  loff_t pos = append ? atomic_long_read(&dev->data_size) : *ppos;
+  size_t count = iov_iter_count(from);
+  size_t size_written = 0;
+  size_t begin_offset;
+  int end_page_no;
+  int curr_page_no;
+  size_t curr_size_written;
+  size_t size_to_be_written;
+  struct page *page;
+  long over;
+  int err;
+
+  if (count == 0)
+    return 0;
+  if (pos + count > ASGN1_MAX_BYTES)
+    return -EFBIG;
+  end_page_no = (pos + count - 1) / PAGE_SIZE;
+
+  /* dirty pages can't be evicted, so under a memory limit, write back
+     enough of them first for this write to fit */
+  over = asgn1_mem_over(dev, end_page_no + 1 - pos / PAGE_SIZE);
+  if (dev->backing && over > 0)
+  {
+    asgn1_flush(dev, over);
+  }
+
+  down_read(&dev->sem);
+
+  /* an append learns where it goes only now; the estimate above sized
+     the write-back */
+  if (append)
+  {
+    pos = asgn1_reserve(dev, count);
+    if (pos < 0)
+    {
+      up_read(&dev->sem);
+      return pos;
+    }
+    *ppos = pos;
+    end_page_no = (pos + count - 1) / PAGE_SIZE;
+  }
+
+  /* Pre-allocate the pages this write covers, and only those */
+  err = allocate_pages_range(dev, mapping, pos / PAGE_SIZE, end_page_no + 1);
+  if (err < 0)
+  {
+    if (append)
+      atomic_long_cmpxchg(&dev->data_size, pos + count, pos);
+    up_read(&dev->sem);
+    return err;
+  }
+
+  /* Now write the data page by page without additional allocations */
+  for (curr_page_no = pos / PAGE_SIZE; size_written < count; curr_page_no++)
+  {
+    begin_offset = (pos + size_written) % PAGE_SIZE;
+    size_to_be_written = min(count - size_written, PAGE_SIZE - begin_offset);
+
+    /* copy from the iterator under the page's writer stripe, which also
+       keeps the compactor and the dedup scan off the page */
+    mutex_lock(asgn1_page_lock(dev, curr_page_no));
+    page = asgn1_get_page_for_write(dev, mapping, curr_page_no);
+    if (!page)
+    {
+      /* evicted since it was allocated; allocate it again */
+      mutex_unlock(asgn1_page_lock(dev, curr_page_no));
+      err = allocate_pages_range(dev, mapping, curr_page_no, curr_page_no + 1);
+      if (err < 0)
+        break;
+      curr_page_no--;
+      continue;
+    }
+    if (IS_ERR(page))
+    {
+      mutex_unlock(asgn1_page_lock(dev, curr_page_no));
+      err = PTR_ERR(page);
+      break;
+    }
+    curr_size_written = copy_page_from_iter(page, begin_offset,
+                                            size_to_be_written, from);
+    mutex_unlock(asgn1_page_lock(dev, curr_page_no));
+    asgn1_count_access(dev, page);
+
+    /* dirty before our reference goes, so eviction can't drop the page
+       as clean in between */
+    if (curr_size_written)
+      asgn1_mark_dirty(dev, curr_page_no);
+    put_page(page);
+
+    size_written += curr_size_written;
+
+    if (curr_size_written < size_to_be_written)
+      break; /* partial copy, return what we wrote */
+  }
+
+  if (!append)
+  {
+    asgn1_extend_size(dev, pos + size_written);
+  }
+  else
+  {
+    /* hand back the unwritten tail if nobody has appended after it;
+       otherwise it stays behind as a hole */
+    if (size_written < count)
+      atomic_long_cmpxchg(&dev->data_size, pos + count, pos + size_written);
+    if (size_written && wq_has_sleeper(&dev->data_wait))
+      wake_up_interruptible_poll(&dev->data_wait, EPOLLIN | EPOLLRDNORM);
+  }
+  up_read(&dev->sem);
+
+  /* past dirty_ratio, writers write back for themselves */
+  if (dev->backing && READ_ONCE(writeback_ms) > 0 &&
+      asgn1_over_dirty(dev, READ_ONCE(dirty_ratio)))
+  {
+    asgn1_flush(dev, LONG_MAX);
+  }
+
+  if (size_written == 0)
+    return err ? err : -EINVAL; /* completely failed */
+  return size_written;
+}
+
+static ssize_t asgn1_do_write(struct kiocb *, struct iov_iter *);
+static ssize_t asgn1_do_write(struct kiocb *iocb, struct iov_iter *from)
+{
+  asgn1_dev *dev = iocb->ki_filp->private_data;
+
+  loff_t pos = iocb->ki_pos;
+  ssize_t ret;
+
+  if (dev->ring)
+    return asgn1_ring_write(iocb, from);
+
+  /* O_APPEND writes reserve their range rather than trusting ki_pos */
+  ret = asgn1_write_pages(dev, iocb->ki_filp->f_mapping, &pos, from,
+                          iocb->ki_flags & IOCB_APPEND);
+  if (ret > 0)
+    iocb->ki_pos = pos + ret;
+  return ret;
+}
+
+/**
+ * Write, counting the call, the bytes written and its latency.
+ */
+ssize_t asgn1_write_iter(struct kiocb *, struct iov_iter *);
+ssize_t asgn1_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+  asgn1_dev *dev = iocb->ki_filp->private_data;
+  loff_t pos = iocb->ki_pos;
+  size_t len = iov_iter_count(from);
+  u64 start = ktime_get_ns();
+  ssize_t ret = asgn1_do_write(iocb, from);
+  u64 ns = ktime_get_ns() - start;
+
+  asgn1_count(dev, ASGN1_STAT_WRITES, 1);
+  if (ret > 0)
+    asgn1_count(dev, ASGN1_STAT_WRITE_BYTES, ret);
+  asgn1_time(dev, ASGN1_LAT_WRITE, ns);
+  /* an append went wherever it reserved */
+  if (ret > 0)
+    pos = iocb->ki_pos - ret;
+  trace_asgn1_write(dev->dev, pos, len, ret, ns);
+  return ret;
+}
+
+/**
+ * Set the data size to size. Pages wholly past the new end are freed and
+ * the rest of the last page is zeroed, so growing the device again later
+ * reads back zeros; growing with this leaves a hole.
+ */
+static void asgn1_truncate(asgn1_dev *dev, struct file *filp, loff_t size)
+{
+  unsigned long first = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  int freed;
+
+  down_write(&dev->sem);
+  freed = asgn1_free_range(dev, first, ULONG_MAX);
+  trace_asgn1_truncate(dev->dev, size,
+                       atomic_long_read(&dev->data_size) - size, freed);
+  asgn1_discard_backing(dev, first, ULONG_MAX);
+  if (offset_in_page(size))
+  {
+    asgn1_zero_partial(dev, filp->f_mapping, size,
+                       PAGE_SIZE - offset_in_page(size));
+  }
+  atomic_long_set(&dev->data_size, size);
+  up_write(&dev->sem);
+
+  unmap_mapping_range(filp->f_mapping, (loff_t)first << PAGE_SHIFT, 0, 1);
+}
+
+/**
+ * Turn [start, start + len) into a hole. Whole pages inside the range are
+ * freed and the partial pages at either end are zeroed, and dropped from
+ * mapping if it is given. The data size is unchanged.
+ */
+static void asgn1_punch_hole(asgn1_dev *dev, struct address_space *mapping,
+                             loff_t start, loff_t len)
+{
+  loff_t end = start + len;
+  unsigned long first = (start + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  unsigned long last = end >> PAGE_SHIFT; /* first page not wholly inside */
+  int freed = 0;
+
+  down_write(&dev->sem);
+  if (first > last)
+  {
+    /* the range lies inside a single page */
+    asgn1_zero_partial(dev, mapping, start, len);
+  }
+  else
+  {
+    if (offset_in_page(start))
+    {
+      asgn1_zero_partial(dev, mapping, start,
+                         PAGE_SIZE - offset_in_page(start));
+    }
+    if (offset_in_page(end))
+    {
+      asgn1_zero_partial(dev, mapping, end & PAGE_MASK,
+                         offset_in_page(end));
+    }
+    if (first < last)
+    {
+      freed = asgn1_free_range(dev, first, last - 1);
+      asgn1_discard_backing(dev, first, last);
+    }
+  }
+  up_write(&dev->sem);
+  trace_asgn1_punch_hole(dev->dev, start, len, freed);
+
+  if (mapping && first < last)
+  {
+    unmap_mapping_range(mapping, (loff_t)first << PAGE_SHIFT,
+                        (loff_t)(last - first) << PAGE_SHIFT, 1);
+  }
+}
+
+/**
+ * Give page dst_no of dst the data of page src_no of src: the same page,
+ * counted in its share count as dedup does, or a private copy if the
+ * page changed under us. A hole in src makes a hole in dst. The caller
+ * holds dst->sem for writing and src->sem at least shared. Returns
+ * whether the page was shared, or an error.
+ */
+static int asgn1_clone_page(asgn1_dev *dst, unsigned long dst_no,
+                            asgn1_dev *src, unsigned long src_no)
+{
+  struct page *page, *copy;
+  page_node *node, *snode;
+  bool share;
+  int err;
+
+  page = asgn1_get_page_ref(src, src_no);
+  if (IS_ERR(page))
+    return PTR_ERR(page);
+
+  asgn1_free_range(dst, dst_no, dst_no);
+  if (!page)
+  {
+    asgn1_discard_backing(dst, dst_no, dst_no + 1);
+    return 0;
+  }
+
+  if (dst->max_pages && atomic_read(&dst->num_pages) >= dst->max_pages)
+  {
+    put_page(page);
+    return -ENOSPC;
+  }
+
+  node = kmem_cache_alloc_node(asgn1_cache, GFP_KERNEL, page_to_nid(page));
+  if (!node)
+  {
+    put_page(page);
+    return -ENOMEM;
+  }
+
+  xa_lock(&src->pages);
+  snode = xa_load(&src->pages, src_no);
+  share = snode && snode->page == page;
+  if (share)
+    asgn1_share_get(page);
+  xa_unlock(&src->pages);
+
+  if (!share)
+  {
+    if (asgn1_alloc_pages(dst, &copy, 1) != 1)
+    {
+      put_page(page);
+      kmem_cache_free(asgn1_cache, node);
+      return -ENOMEM;
+    }
+    copy_highpage(copy, page);
+    put_page(page);
+    page = copy;
+  }
+
+  /* our reference becomes the node's */
+  asgn1_init_node(node, page);
+  err = xa_insert(&dst->pages, dst_no, node, GFP_KERNEL);
+  if (err)
+  {
+    /* an mmap write fault got there first */
+    free_page_node(dst, node);
+    return err == -EBUSY ? -EAGAIN : err;
+  }
+  atomic_inc(&dst->num_pages);
+  atomic_inc(&dst->resident);
+  asgn1_mark_dirty(dst, dst_no);
+
+  /* a write fault may have made the page writable just before it was
+     counted; it keeps the page locked until then */
+  if (share)
+  {
+    lock_page(page);
+    unlock_page(page);
+  }
+  return share;
+}
+
+/**
+ * Clone nr whole pages from page src_no of src to page dst_no of dst,
+ * sharing them where possible, and write-protect the source pages in
+ * src_mapping so the next write to either copy faults and unshares it.
+ * With two devices, the one at the higher address is locked first, the
+ * same order a snapshot slot and its device are locked in.
+ */
+static int asgn1_share_range(asgn1_dev *dst, struct address_space *dst_mapping,
+                             asgn1_dev *src, struct address_space *src_mapping,
+                             unsigned long src_no, unsigned long dst_no,
+                             unsigned long nr)
+{
+  unsigned long i;
+  int err = 0;
+
+  if (src == dst)
+  {
+    down_write(&dst->sem);
+  }
+  else if (src > dst)
+  {
+    down_read(&src->sem);
+    down_write(&dst->sem);
+  }
+  else
+  {
+    down_write(&dst->sem);
+    down_read(&src->sem);
+  }
+
+  for (i = 0; i < nr; i++)
+  {
+    err = asgn1_clone_page(dst, dst_no + i, src, src_no + i);
+    if (err == -EAGAIN)
+      i--; /* free the faulted-in page and try again */
+    else if (err < 0)
+      break;
+    cond_resched();
+  }
+
+  /* before dedup can see a shared page still mapped writable */
+  unmap_mapping_range(src_mapping, (loff_t)src_no << PAGE_SHIFT,
+                      (loff_t)i << PAGE_SHIFT, 0);
+  unmap_mapping_range(dst_mapping, (loff_t)dst_no << PAGE_SHIFT,
+                      (loff_t)i << PAGE_SHIFT, 1);
+
+  if (src != dst)
+    up_read(&src->sem);
+  up_write(&dst->sem);
+  return err < 0 ? err : 0;
+}
+
+/**
+ * Copy len bytes at src_pos of src to dst_pos of dst through the kernel,
+ * a page of src at a time, with the write path doing the rest. Holes in
+ * src are written as zeros. Returns the bytes copied, or an error if
+ * there were none.
+ */
+static ssize_t asgn1_copy_range(asgn1_dev *dst, struct address_space *mapping,
+                                asgn1_dev *src, loff_t src_pos, loff_t dst_pos,
+                                size_t len)
+{
+  struct iov_iter iter;
+  struct bio_vec bvec;
+  struct page *page;
+  size_t done = 0, n;
+  loff_t pos;
+  ssize_t ret;
+
+  while (done < len)
+  {
+    n = min_t(size_t, len - done, PAGE_SIZE - offset_in_page(src_pos + done));
+
+    down_read(&src->sem);
+    page = asgn1_get_page_ref(src, (src_pos + done) >> PAGE_SHIFT);
+    up_read(&src->sem);
+    if (IS_ERR(page))
+      return done ? done : PTR_ERR(page);
+
+    bvec_set_page(&bvec, page ? page : ZERO_PAGE(0), n,
+                  offset_in_page(src_pos + done));
+    iov_iter_bvec(&iter, ITER_SOURCE, &bvec, 1, n);
+    pos = dst_pos + done;
+    ret = asgn1_write_pages(dst, mapping, &pos, &iter, false);
+    if (page)
+      put_page(page);
+    if (ret < 0)
+      return done ? done : ret;
+
+    done += ret;
+    if (ret < n)
+      break;
+  }
+  return done;
+}
+
+/**
+ * Clone a range of the asgn1 device open as arg->src_fd into the device
+ * open as filp, for TEM_CLONE_RANGE. The range stops at the end of the
+ * source data. Where source and destination start at the same offset in
+ * a page, the whole pages between are shared copy-on-write; the rest is
+ * copied in the kernel. Overlapping ranges of one device are refused.
+ */
+static long asgn1_clone_range(struct file *filp, struct asgn1_clone_range *arg)
+{
+  asgn1_dev *dst = filp->private_data, *src;
+  loff_t src_pos = arg->src_offset, dst_pos = arg->dest_offset;
+  struct file *src_file;
+  size_t len, head, data_size;
+  unsigned long nr;
+  ssize_t ret;
+  int err;
+
+  if (arg->src_offset > ASGN1_MAX_BYTES || arg->dest_offset > ASGN1_MAX_BYTES ||
+      arg->src_length > ASGN1_MAX_BYTES)
+    return -EINVAL;
+
+  src_file = fget(arg->src_fd);
+  if (!src_file)
+    return -EBADF;
+
+  ret = -EXDEV;
+  if (src_file->f_op != filp->f_op)
+    goto out;
+  ret = -EBADF;
+  if (!(src_file->f_mode & FMODE_READ))
+    goto out;
+  src = src_file->private_data;
+  ret = -EINVAL;
+  if (src->ring)
+    goto out;
+
+  data_size = atomic_long_read(&src->data_size);
+  ret = 0;
+  if (src_pos >= data_size)
+    goto out;
+  len = min_t(size_t, arg->src_length, data_size - src_pos);
+
+  ret = -EFBIG;
+  if (dst_pos + len > ASGN1_MAX_BYTES)
+    goto out;
+  ret = -EINVAL;
+  if (src == dst && src_pos < dst_pos + len && dst_pos < src_pos + len)
+    goto out;
+
+  /* the bytes before the first whole page that can be shared */
+  head = len;
+  nr = 0;
+  if (offset_in_page(src_pos) == offset_in_page(dst_pos))
+  {
+    head = min_t(size_t, len, (PAGE_SIZE - offset_in_page(src_pos)) % PAGE_SIZE);
+    nr = (len - head) >> PAGE_SHIFT;
+  }
+
+  ret = asgn1_copy_range(dst, filp->f_mapping, src, src_pos, dst_pos, head);
+  if (ret < (ssize_t)head)
+    goto out;
+
+  if (nr)
+  {
+    err = asgn1_share_range(dst, filp->f_mapping, src, src_file->f_mapping,
+                            (src_pos + head) >> PAGE_SHIFT,
+                            (dst_pos + head) >> PAGE_SHIFT, nr);
+    if (err)
+    {
+      ret = head ? head : err;
+      goto out;
+    }
+  }
+
+  head += nr << PAGE_SHIFT;
+  ret = asgn1_copy_range(dst, filp->f_mapping, src, src_pos + head,
+                         dst_pos + head, len - head);
+  if (ret >= 0)
+    ret += head;
+  else if (head)
+    ret = head;
+
+  asgn1_extend_size(dst, dst_pos + (ret > 0 ? ret : 0));
+
+out:
+  fput(src_file);
+  return ret;
+}
+
+/**
+ * Allocate every page of [start, start + len) now, so later writes there
+ * never have to. The data size is unchanged.
+ */
+static int asgn1_prealloc(asgn1_dev *dev, struct address_space *mapping,
+                          loff_t start, loff_t len)
+{
+  int err;
+
+  down_read(&dev->sem);
+  err = allocate_pages_range(dev, mapping, start >> PAGE_SHIFT,
+                             (start + len + PAGE_SIZE - 1) >> PAGE_SHIFT);
+  up_read(&dev->sem);
+
+  return err;
+}
+
+/**
+ * Fill the snapshot slot of dev with a point-in-time copy of it. Every
+ * resident page is shared by the two devices, counted in its share count
+ * like a deduped page, so this costs one node per page rather than a
+ * copy of the data; compressed copies are shared too, and pages not yet
+ * restored from the backing file are left there. The slot is
+ * read-only unless writable is set, which makes it a clone. It is
+ * replaced only while nobody has it open.
+ */
+static int asgn1_snapshot(asgn1_dev *dev, struct file *filp, bool writable)
+{
+  asgn1_dev *slot = dev->snapshot;
+  page_node *node, *snode;
+  unsigned long index;
+  struct page *page;
+  int err = 0;
+
+  if (!slot)
+  {
+    return -EINVAL;
+  }
+
+  down_write(&slot->sem);
+  if (atomic_read(&slot->nprocs) > 0)
+  {
+    up_write(&slot->sem);
+    return -EBUSY;
+  }
+  free_memory_pages(slot);
+  slot->readonly = !writable;
+
+  /* holding zlock, compressed nodes stay compressed */
+  down_write(&dev->sem);
+  mutex_lock(&dev->zlock);
+  xa_for_each(&dev->pages, index, node)
+  {
+    snode = kmem_cache_alloc(asgn1_cache, GFP_KERNEL);
+    if (!snode)
+    {
+      err = -ENOMEM;
+      break;
+    }
+
+    xa_lock(&dev->pages);
+    page = node->page;
+    if (page)
+    {
+      get_page(page);
+      asgn1_share_get(page);
+    }
+    xa_unlock(&dev->pages);
+    asgn1_init_node(snode, page);
+
+    /*
+     * A compressed node shares its copy, which is never modified, only
+     * replaced. An on-file node stays on file; the slot reads our
+     * backing file.
+     */
+    if (!page && node->zdata)
+    {
+      refcount_inc(&node->zdata->ref);
+      snode->zdata = node->zdata;
+      snode->zlen = node->zlen;
+      atomic_inc(&slot->zpages);
+      atomic_long_add(snode->zlen, &slot->zbytes);
+    }
+
+    err = xa_insert(&slot->pages, index, snode, GFP_KERNEL);
+    if (err)
+    {
+      free_page_node(slot, snode);
+      break;
+    }
+    if (page)
+      atomic_inc(&slot->resident);
+    atomic_inc(&slot->num_pages);
+  }
+  mutex_unlock(&dev->zlock);
+  atomic_long_set(&slot->data_size, atomic_long_read(&dev->data_size));
+
+  if (err)
+  {
+    up_write(&dev->sem);
+    free_memory_pages(slot);
+    up_write(&slot->sem);
+    return err;
+  }
+
+  /*
+   * An mmap write fault may have made a page writable just before it was
+   * counted; the page stays locked until then, so wait for each one, and
+   * then write-protect every mapping of the device. This is done before
+   * dev->sem goes, so the dedup scan never sees a shared page that is
+   * still mapped writable.
+   */
+  xa_for_each(&slot->pages, index, snode)
+  {
+    if (snode->page)
+    {
+      lock_page(snode->page);
+      unlock_page(snode->page);
+    }
+  }
+  unmap_mapping_range(filp->f_mapping, 0, 0, 0);
+  up_write(&dev->sem);
+  up_write(&slot->sem);
+  return 0;
+}
+
+/**
+ * Copy a range argument from user space and check it lies within the
+ * largest possible device.
+ */
+static int asgn1_get_range(unsigned long arg, struct asgn1_range *range)
+{
+  if (copy_from_user(range, (void __user *)arg, sizeof(*range)))
+  {
+    return -EFAULT;
+  }
+
+  if (range->len == 0 || range->offset > (u64)ASGN1_MAX_BYTES ||
+      range->len > (u64)ASGN1_MAX_BYTES - range->offset)
+  {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * The ioctl function, which nothing needs to be done in this case.
+ */
+long asgn1_ioctl(struct file *, unsigned, unsigned long);
+long asgn1_ioctl(struct file *filp, unsigned cmd, unsigned long arg)
+{
+  asgn1_dev *dev = filp->private_data;
+  int nr;
+  int new_nprocs;
+  int new_pool;
+  u64 new_size;
+  u64 new_limit;
+  struct asgn1_range range;
+  struct asgn1_clone_range clone;
+  bool woke;
+  int err;
+
+  /* check whether cmd is for our device, if not for us, return -EINVAL */
+  if (_IOC_TYPE(cmd) != MYIOC_TYPE)
+  {
+    return -EINVAL;
+  }
+
+  /* get command, and if command is SET_NPROC_OP, then get the data */
+  nr = _IOC_NR(cmd);
+
+  /* RING_KICK_OP wakes the consumer of a ring; a ring has no page index
+     for the other commands to work on */
+  if (nr == RING_KICK_OP)
+  {
+    if (!dev->ring)
+    {
+      return -EINVAL;
+    }
+    wake_up_interruptible_poll(&dev->data_wait, EPOLLIN | EPOLLRDNORM);
+    return 0;
+  }
+  if (dev->ring && nr != SET_NPROC_OP)
+  {
+    return -EINVAL;
+  }
+
+  if (nr == SET_NPROC_OP)
+  {
+    if (copy_from_user(&new_nprocs, (int __user *)arg, sizeof(int)))
+    {
+      return -EFAULT;
+    }
+
+    /* check validity of the value before setting max_nprocs */
+    if (new_nprocs <= 0)
+    {
+      return -EINVAL;
+    }
+
+    /* a higher limit admits waiting opens at once */
+    spin_lock(&dev->open_lock);
+    atomic_set(&dev->max_nprocs, new_nprocs);
+    woke = asgn1_admit_queued(dev);
+    spin_unlock(&dev->open_lock);
+    if (woke)
+    {
+      wake_up_all(&dev->open_wait);
+    }
+    return 0;
+  }
+
+  /* SET_POOL_OP sets how many freed pages the device keeps for reuse */
+  if (nr == SET_POOL_OP)
+  {
+    if (copy_from_user(&new_pool, (int __user *)arg, sizeof(int)))
+    {
+      return -EFAULT;
+    }
+
+    if (new_pool < 0)
+    {
+      return -EINVAL;
+    }
+
+    asgn1_set_pool_max(dev, new_pool);
+    return 0;
+  }
+
+  /* SET_MEM_LIMIT_OP caps the memory held and evicts down to the cap */
+  if (nr == SET_MEM_LIMIT_OP)
+  {
+    if (copy_from_user(&new_limit, (u64 __user *)arg, sizeof(u64)))
+    {
+      return -EFAULT;
+    }
+
+    if (new_limit > (u64)ASGN1_MAX_BYTES)
+    {
+      return -EINVAL;
+    }
+
+    WRITE_ONCE(dev->mem_limit, DIV_ROUND_UP_ULL(new_limit, PAGE_SIZE));
+    asgn1_make_room(dev, 0);
+    return 0;
+  }
+
+  /* the remaining commands change the contents of the device or its slot */
+  if (nr == TRUNCATE_OP || nr == PUNCH_HOLE_OP || nr == PREALLOC_OP ||
+      nr == SNAPSHOT_OP || nr == CLONE_OP || nr == CLONE_RANGE_OP)
+  {
+    if (!(filp->f_mode & FMODE_WRITE))
+    {
+      return -EBADF;
+    }
+  }
+
+  if (nr == TRUNCATE_OP)
+  {
+    if (copy_from_user(&new_size, (u64 __user *)arg, sizeof(u64)))
+    {
+      return -EFAULT;
+    }
+
+    if (new_size > (u64)ASGN1_MAX_BYTES)
+    {
+      return -EFBIG;
+    }
+
+    asgn1_truncate(dev, filp, new_size);
+    return 0;
+  }
+
+  if (nr == PUNCH_HOLE_OP)
+  {
+    err = asgn1_get_range(arg, &range);
+    if (err)
+    {
+      return err;
+    }
+
+    asgn1_punch_hole(dev, filp->f_mapping, range.offset, range.len);
+    return 0;
+  }
+
+  if (nr == PREALLOC_OP)
+  {
+    err = asgn1_get_range(arg, &range);
+    if (err)
+    {
+      return err;
+    }
+
+    return asgn1_prealloc(dev, filp->f_mapping, range.offset, range.len);
+  }
+
+  if (nr == SNAPSHOT_OP || nr == CLONE_OP)
+  {
+    return asgn1_snapshot(dev, filp, nr == CLONE_OP);
+  }
+
+  if (nr == CLONE_RANGE_OP)
+  {
+    if (copy_from_user(&clone, (void __user *)arg, sizeof(clone)))
+    {
+      return -EFAULT;
+    }
+
+    return asgn1_clone_range(filp, &clone);
+  }
+
+  return -ENOTTY;
+}
+
+/**
+ * Map the existing pages in the fault_around_pages aligned window around
+ * the faulting page, so sequential access takes one fault per window
+ * rather than one per page. In extent mode the window covers at least a
+ * whole extent.
+ */
+static void asgn1_fault_around(asgn1_dev *dev, struct vm_fault *vmf)
+{
+  struct vm_area_struct *vma = vmf->vma;
+  unsigned long nr = clamp(max(fault_around_pages, 1 << extent_order), 1,
+                           ASGN1_FAULT_AROUND_MAX);
+  unsigned long first = vma->vm_pgoff;
+  unsigned long last = vma->vm_pgoff + vma_pages(vma);
+  unsigned long start, end, index;
+  struct page *page;
+
+  if (nr <= 1)
+    return;
+
+  start = vmf->pgoff - (vmf->pgoff - first) % nr;
+  end = min(last, start + nr);
+
+  for (index = start; index < end; index++)
+  {
+    if (index == vmf->pgoff)
+      continue;
+
+    /* leave compressed neighbours alone until they are touched */
+    page = __asgn1_get_page_ref(dev, index, true);
+    if (!page)
+      continue;
+
+    /* -EBUSY just means the page is already mapped */
+    vm_insert_page(vma, vma->vm_start + ((index - first) << PAGE_SHIFT), page);
+    put_page(page);
+  }
+}
+
+/**
+ * Map the zero page over the hole at vmf->pgoff, read-only. If a write
+ * filled the hole meanwhile, it may have looked for our mapping before
+ * it was there, so it is dropped again and the fault retried.
+ */
+static vm_fault_t asgn1_map_zero(asgn1_dev *dev, struct vm_fault *vmf)
+{
+  vm_fault_t ret;
+
+  ret = vmf_insert_mixed(vmf->vma, vmf->address,
+                         pfn_to_pfn_t(my_zero_pfn(vmf->address)));
+  if (ret == VM_FAULT_NOPAGE && xa_load(&dev->pages, vmf->pgoff))
+  {
+    unmap_mapping_range(vmf->vma->vm_file->f_mapping,
+                        (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE, 0);
+  }
+  return ret;
+}
+
+/**
+ * The mmap fault handler. Pages are installed on first touch. A read
+ * fault, or a private write fault, on a hole inside the device maps the
+ * zero page, and the core copies it for a private write; a shared write
+ * fault allocates a zeroed page, beyond the end of the device too, so
+ * the device can grow through a shared mapping. A compressed page is
+ * decompressed before it is mapped. This path never takes dev->sem,
+ * since read() and write() may fault on a mapping of this device while
+ * holding it.
+ */
+static vm_fault_t asgn1_do_fault(struct vm_fault *vmf)
+{
+  asgn1_dev *dev = vmf->vma->vm_private_data;
+  struct address_space *mapping = vmf->vma->vm_file->f_mapping;
+  bool grow = (vmf->flags & FAULT_FLAG_WRITE) &&
+              (vmf->vma->vm_flags & VM_SHARED);
+  bool in_hole;
+  struct page *page;
+
+again:
+  page = asgn1_get_page_ref(dev, vmf->pgoff);
+  if (IS_ERR(page))
+    return PTR_ERR(page) == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+  if (!page)
+  {
+    in_hole = ((loff_t)vmf->pgoff << PAGE_SHIFT) <
+              atomic_long_read(&dev->data_size);
+    if (!grow && !in_hole)
+      return VM_FAULT_SIGBUS;
+    if (!grow)
+      return asgn1_map_zero(dev, vmf);
+
+    switch (allocate_pages_range(dev, mapping, vmf->pgoff, vmf->pgoff + 1))
+    {
+    case 0:
+      break;
+    case -ENOSPC:
+      return VM_FAULT_SIGBUS;
+    default:
+      return VM_FAULT_OOM;
+    }
+
+    /* eviction may take the new page before we get to it */
+    page = asgn1_get_page_ref(dev, vmf->pgoff);
+    if (!page)
+      goto again;
+    if (IS_ERR(page))
+      return VM_FAULT_SIGBUS;
+  }
+
+  if (grow)
+  {
+    asgn1_extend_size(dev, (vmf->pgoff + 1) << PAGE_SHIFT);
+  }
+
+  asgn1_fault_around(dev, vmf);
+  asgn1_count_access(dev, page);
+
+  /* hand our reference to the core, which maps the page */
+  vmf->page = page;
+  return 0;
+}
+
+static vm_fault_t asgn1_vm_fault(struct vm_fault *vmf)
+{
+  asgn1_dev *dev = vmf->vma->vm_private_data;
+  u64 start = ktime_get_ns();
+  vm_fault_t ret = asgn1_do_fault(vmf);
+  u64 ns = ktime_get_ns() - start;
+
+  asgn1_count(dev, ASGN1_STAT_FAULTS, 1);
+  asgn1_time(dev, ASGN1_LAT_FAULT, ns);
+  trace_asgn1_fault(dev->dev, vmf->pgoff, vmf->flags & FAULT_FLAG_WRITE,
+                    ret, ns);
+  return ret;
+}
+
+/**
+ * Called before a page mapped read-only becomes writable. A page shared
+ * by dedup is given a private copy; its read-only mapping is dropped and
+ * the fault retried, so the copy is mapped instead. Otherwise the page is
+ * returned locked, which keeps the dedup scan away from it until it is
+ * mapped writable.
+ */
+static vm_fault_t asgn1_vm_page_mkwrite(struct vm_fault *vmf)
+{
+  asgn1_dev *dev = vmf->vma->vm_private_data;
+  struct address_space *mapping = vmf->vma->vm_file->f_mapping;
+  struct page *page = vmf->page;
+  page_node *node;
+  bool exclusive;
+
+  lock_page(page);
+  xa_lock(&dev->pages);
+  node = xa_load(&dev->pages, vmf->pgoff);
+  exclusive = node && node->page == page &&
+              !asgn1_page_shared(dev, vmf->pgoff, page);
+  xa_unlock(&dev->pages);
+  if (exclusive)
+  {
+    asgn1_mark_dirty(dev, vmf->pgoff);
+    return VM_FAULT_LOCKED;
+  }
+  unlock_page(page);
+
+  /* shared, or a stale mapping of a page the node no longer holds */
+  get_page(page);
+  page = asgn1_unshare_page(dev, mapping, vmf->pgoff, page);
+  if (page == ERR_PTR(-ENOMEM))
+    return VM_FAULT_OOM;
+  if (!IS_ERR(page))
+    put_page(page);
+
+  unmap_mapping_range(mapping, (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE, 0);
+  return VM_FAULT_NOPAGE;
+}
+
+/**
+ * Called before the zero page mapped over a hole becomes writable in a
+ * shared mapping. The hole is filled and the zero page unmapped, and the
+ * fault retried, so the new page is mapped instead.
+ */
+static vm_fault_t asgn1_vm_pfn_mkwrite(struct vm_fault *vmf)
+{
+  asgn1_dev *dev = vmf->vma->vm_private_data;
+  struct address_space *mapping = vmf->vma->vm_file->f_mapping;
+
+  switch (allocate_pages_range(dev, mapping, vmf->pgoff, vmf->pgoff + 1))
+  {
+  case 0:
+    break;
+  case -ENOSPC:
+    return VM_FAULT_SIGBUS;
+  default:
+    return VM_FAULT_OOM;
+  }
+
+  /* filled by someone else, whose unmap may have run before our map */
+  unmap_mapping_range(mapping, (loff_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE, 0);
+  return VM_FAULT_NOPAGE;
+}
+
+static const struct vm_operations_struct asgn1_vm_ops = {
+    .fault = asgn1_vm_fault,
+    .page_mkwrite = asgn1_vm_page_mkwrite,
+    .pfn_mkwrite = asgn1_vm_pfn_mkwrite,
+};
+
+/**
+ * Set up a mapping of the device. Nothing is mapped here unless
+ * eager_mmap is set; pages are installed by asgn1_vm_fault() on first
+ * touch, so mmap() cost does not depend on the mapping length, and a
+ * mapping may extend beyond the current end of the device.
+ */
+static int asgn1_mmap(struct file *, struct vm_area_struct *);
+static int asgn1_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  asgn1_dev *dev = filp->private_data;
+  u64 start = ktime_get_ns(), ns;
+  unsigned long index;
+  struct page *page;
+  pgprot_t prot;
+  int err = 0;
+
+  /* page numbers are ints throughout the driver */
+  if (vma->vm_pgoff + vma_pages(vma) > INT_MAX)
+  {
+    return -EINVAL;
+  }
+
+  if (dev->ring)
+  {
+    return asgn1_ring_mmap(dev, vma);
+  }
+
+  /* VM_MIXEDMAP lets the fault handler map neighbouring pages itself */
+  vm_flags_set(vma, VM_MIXEDMAP);
+  vma->vm_ops = &asgn1_vm_ops;
+  vma->vm_private_data = dev;
+
+  /* the block device has no file of its own to unmap pages through */
+  if (dev->disk && !READ_ONCE(dev->mapped) &&
+      !cmpxchg(&dev->mapped, NULL, file_inode(filp)))
+  {
+    ihold(file_inode(filp));
+  }
+
+  /*
+   * Eager mode: map every resident page up front. The pages go in
+   * read-only, so the first store to a shared mapping still goes through
+   * asgn1_vm_page_mkwrite() to break dedup sharing and mark the page
+   * dirty.
+   */
+  prot = vma->vm_page_prot;
+  vma->vm_page_prot = pgprot_modify(prot,
+                                    vm_get_page_prot(vma->vm_flags &
+                                                     ~VM_WRITE));
+  for (index = 0; eager_mmap && index < vma_pages(vma); index++)
+  {
+    page = __asgn1_get_page_ref(dev, vma->vm_pgoff + index, true);
+    if (!page)
+      continue;
+
+    err = vm_insert_page(vma, vma->vm_start + (index << PAGE_SHIFT), page);
+    put_page(page);
+    if (err)
+      break;
+  }
+  vma->vm_page_prot = prot;
+
+  ns = ktime_get_ns() - start;
+  asgn1_time(dev, ASGN1_LAT_MMAP, ns);
+  trace_asgn1_mmap(dev->dev, vma->vm_pgoff, vma_pages(vma), err, ns);
+  return err;
+}
+
+/**
+ * Readable while the file position is short of the data size, and
+ * writable, if opened for writing, while the device is under its page
+ * limit. Pollers are woken when the data grows or pages are freed.
+ */
+static __poll_t asgn1_poll(struct file *, poll_table *);
+static __poll_t asgn1_poll(struct file *filp, poll_table *wait)
+{
+  asgn1_dev *dev = filp->private_data;
+  __poll_t mask = 0;
+
+  poll_wait(filp, &dev->data_wait, wait);
+
+  /* a ring is always writable, by overwriting */
+  if (dev->ring)
+  {
+    if (asgn1_ring_ready(dev))
+      mask |= EPOLLIN | EPOLLRDNORM;
+    if (filp->f_mode & FMODE_WRITE)
+      mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+  }
+
+  if (filp->f_pos < atomic_long_read(&dev->data_size))
+    mask |= EPOLLIN | EPOLLRDNORM;
+  if ((filp->f_mode & FMODE_WRITE) &&
+      (!dev->max_pages || atomic_read(&dev->num_pages) < dev->max_pages))
+    mask |= EPOLLOUT | EPOLLWRNORM;
+  return mask;
+}
+
+struct file_operations asgn1_fops = {
+    .owner = THIS_MODULE,
+    .read_iter = asgn1_read_iter,
+    .write_iter = asgn1_write_iter,
+    .splice_read = asgn1_splice_read,
+    .splice_write = iter_file_splice_write,
+    .unlocked_ioctl = asgn1_ioctl,
+    .open = asgn1_open,
+    .mmap = asgn1_mmap,
+    .release = asgn1_release,
+    .poll = asgn1_poll,
+    .fsync = asgn1_fsync,
+    .llseek = asgn1_lseek};
+
+/**
+ * Compress the page behind node, unless it is in use. The caller holds
+ * dev->sem shared, the writer stripe for index and zlock, so the node
+ * cannot be freed and write() cannot change the page underneath us. A
+ * page that is mapped, or being read, holds an extra reference and is
+ * left alone; the reference count is checked again before the page is
+ * dropped, in case it was mapped while we were compressing it.
+ */
+static void asgn1_compress_page(asgn1_dev *dev, unsigned long index,
+                                page_node *node)
+{
+  struct scatterlist src, dst;
+  unsigned int zlen = 2 * PAGE_SIZE;
+  struct page *page;
+  asgn1_zdata *zdata;
+  bool swapped = false;
+
+  xa_lock(&dev->pages);
+  page = node->page;
+  if (page && page_ref_count(page) == 1)
+    get_page(page);
+  else
+    page = NULL;
+  xa_unlock(&dev->pages);
+  if (!page)
+    return;
+
+  sg_init_table(&src, 1);
+  sg_set_page(&src, page, PAGE_SIZE, 0);
+  sg_init_one(&dst, asgn1_zbuf, zlen);
+  if (asgn1_zcall(true, &src, PAGE_SIZE, &dst, &zlen) || zlen > ASGN1_ZMAX)
+  {
+    /* not worth it; don't try again until the page goes cold again */
+    node->atime = jiffies;
+    put_page(page);
+    return;
+  }
+
+  zdata = kmalloc(struct_size(zdata, data, zlen), GFP_KERNEL | __GFP_NOWARN);
+  if (zdata)
+  {
+    refcount_set(&zdata->ref, 1);
+    memcpy(zdata->data, asgn1_zbuf, zlen);
+    xa_lock(&dev->pages);
+    if (node->page == page && page_ref_count(page) == 2)
+    {
+      node->page = NULL;
+      node->zdata = zdata;
+      node->zlen = zlen;
+      swapped = true;
+    }
+    xa_unlock(&dev->pages);
+  }
+
+  put_page(page);
+  if (!swapped)
+  {
+    kfree(zdata);
+    return;
+  }
+
+  asgn1_free_page(dev, page);
+  atomic_dec(&dev->resident);
+  atomic_inc(&dev->zpages);
+  atomic_long_add(zlen, &dev->zbytes);
+}
+
+/**
+ * Called by a background walk of the index holding dev->sem shared, for
+ * each node it looks at. Every ASGN1_WALK_BATCH nodes, if a truncation
+ * is waiting for the semaphore, it is dropped and taken again behind it,
+ * so readers and writers queued behind the truncation are not held up
+ * for the whole walk. xa_for_each() carries on from the next index, so
+ * the walk copes with pages freed meanwhile.
+ */
+static void asgn1_walk_yield(asgn1_dev *dev, int *seen)
+{
+  if (++*seen % ASGN1_WALK_BATCH || !rwsem_is_contended(&dev->sem))
+    return;
+
+  up_read(&dev->sem);
+  cond_resched();
+  down_read(&dev->sem);
+}
+
+/**
+ * Compress the pages of dev that have not been touched for compress_secs.
+ * Pages whose writer stripe is busy are being written and are skipped.
+ * The walk does not start while the device is being truncated, and
+ * steps aside for a truncation that comes along while it runs. Nodes are
+ * only looked at under zlock, since eviction may discard them at any
+ * time.
+ */
+static void asgn1_compact_device(asgn1_dev *dev)
+{
+  unsigned long cold = jiffies - compress_secs * HZ;
+  unsigned long index;
+  page_node *node;
+  int seen = 0;
+
+  if (!down_read_trylock(&dev->sem))
+    return;
+
+  xa_for_each(&dev->pages, index, node)
+  {
+    asgn1_walk_yield(dev, &seen);
+
+    if (!mutex_trylock(asgn1_page_lock(dev, index)))
+      continue;
+
+    /* eviction may have freed the node; look again holding zlock */
+    mutex_lock(&dev->zlock);
+    node = xa_load(&dev->pages, index);
+    if (node && node->page && !time_after(node->atime, cold))
+      asgn1_compress_page(dev, index, node);
+    mutex_unlock(&dev->zlock);
+    mutex_unlock(asgn1_page_lock(dev, index));
+    cond_resched();
+  }
+
+  up_read(&dev->sem);
+}
+
+/**
+ * The background compactor, run every compress_secs while compression
+ * is enabled. It is the only user of asgn1_zbuf.
+ */
+static void asgn1_compact_work(struct work_struct *work)
+{
+  int i;
+
+  for (i = 0; i < asgn1_nr_devs; i++)
+  {
+    asgn1_compact_device(&asgn1_devices[i]);
+  }
+  schedule_delayed_work(&asgn1_compactor, compress_secs * HZ);
+}
+
+/**
+ * Set up the compression tier if compress_secs asks for it.
+ */
+static int asgn1_compress_init(void)
+{
+  if (compress_secs <= 0)
+    return 0;
+
+  if (compress_secs > INT_MAX / HZ)
+  {
+    printk(KERN_WARNING "%s: compress_secs is too large\n", MYDEV_NAME);
+    return -EINVAL;
+  }
+
+  asgn1_ztfm = crypto_alloc_acomp(compress_alg, 0, 0);
+  if (IS_ERR(asgn1_ztfm))
+  {
+    printk(KERN_WARNING "%s: can't use compression algorithm %s\n",
+           MYDEV_NAME, compress_alg);
+    return PTR_ERR(asgn1_ztfm);
+  }
+
+  asgn1_zbuf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+  if (!asgn1_zbuf)
+  {
+    crypto_free_acomp(asgn1_ztfm);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+/**
+ * Tear down the compression tier. The compactor must have been stopped
+ * and every compressed page freed.
+ */
+static void asgn1_compress_exit(void)
+{
+  if (!asgn1_zbuf)
+    return;
+
+  kfree(asgn1_zbuf);
+  crypto_free_acomp(asgn1_ztfm);
+}
+
+/**
+ * Whether two pages hold the same data.
+ */
+static bool asgn1_same_page(struct page *a, struct page *b)
+{
+  void *pa = kmap_local_page(a);
+  void *pb = kmap_local_page(b);
+  bool same = !memcmp(pa, pb, PAGE_SIZE);
+
+  kunmap_local(pb);
+  kunmap_local(pa);
+  return same;
+}
+
+/**
+ * Make page index share the page at page number other, if both hold the
+ * same data. The caller holds the writer stripe for index and a reference
+ * to its page, pi. Both pages are locked while they are compared, which
+ * keeps out mmap write faults that are about to map either one writable.
+ * pi must not be in use by anyone else, and the page at other must either
+ * be shared already or not be mapped, so no writable mapping of it can
+ * exist once it is shared.
+ */
+static bool asgn1_dedup_merge(asgn1_dev *dev, unsigned long index,
+                              struct page *pi, unsigned long other)
+{
+  struct mutex *lock = asgn1_page_lock(dev, other);
+  bool locked = lock != asgn1_page_lock(dev, index);
+  page_node *ni, *nj;
+  struct page *pj;
+  bool merged = false;
+
+  if (locked && !mutex_trylock(lock))
+    return false;
+
+  pj = __asgn1_get_page_ref(dev, other, true);
+  if (!pj || pj == pi)
+    goto out;
+  if (!trylock_page(pi))
+    goto out_put;
+  if (!trylock_page(pj))
+    goto out_unlock;
+
+  if (asgn1_same_page(pi, pj))
+  {
+    xa_lock(&dev->pages);
+    ni = xa_load(&dev->pages, index);
+    nj = xa_load(&dev->pages, other);
+    if (ni && nj && ni->page == pi && nj->page == pj &&
+        page_ref_count(pi) == 2 &&
+        (page_private(pj) > 1 || !page_mapped(pj)))
+    {
+      ni->page = pj;
+      get_page(pj);
+      asgn1_share_get(pj);
+      merged = true;
+    }
+    xa_unlock(&dev->pages);
+  }
+
+  unlock_page(pj);
+out_unlock:
+  unlock_page(pi);
+out_put:
+  if (pj)
+    put_page(pj);
+out:
+  if (locked)
+    mutex_unlock(lock);
+
+  if (merged)
+  {
+    /* the node's reference to pi; the caller still holds one */
+    put_page(pi);
+  }
+  return merged;
+}
+
+/**
+ * Hash the page at index and share it with an identical page seen
+ * earlier in this scan, or remember it if there is none. The caller
+ * holds the writer stripe for index.
+ */
+static void asgn1_dedup_page(asgn1_dev *dev, unsigned long index)
+{
+  struct asgn1_dedup_entry *entry;
+  struct page *page;
+  void *addr;
+  u32 hash;
+
+  page = __asgn1_get_page_ref(dev, index, true);
+  if (!page)
+    return;
+
+  addr = kmap_local_page(page);
+  hash = jhash2(addr, PAGE_SIZE / sizeof(u32), 0);
+  kunmap_local(addr);
+
+  hash_for_each_possible(asgn1_dedup_seen, entry, link, hash)
+  {
+    if (entry->hash == hash &&
+        asgn1_dedup_merge(dev, index, page, entry->index))
+    {
+      asgn1_free_page(dev, page);
+      return;
+    }
+  }
+  put_page(page);
+
+  entry = kmalloc(sizeof(*entry), GFP_KERNEL | __GFP_NOWARN);
+  if (entry)
+  {
+    entry->hash = hash;
+    entry->index = index;
+    hash_add(asgn1_dedup_seen, &entry->link, hash);
+  }
+}
+
+/**
+ * Share identical resident pages of dev. Pages whose writer stripe is
+ * busy are being written and are skipped. The scan does not start while
+ * the device is being truncated, and steps aside for a truncation that
+ * comes along while it runs; pages remembered from before are compared
+ * again before they are shared, so it does not matter if they changed.
+ */
+static void asgn1_dedup_device(asgn1_dev *dev)
+{
+  struct asgn1_dedup_entry *entry;
+  struct hlist_node *tmp;
+  unsigned long index;
+  page_node *node;
+  int bucket, seen = 0;
+
+  if (!down_read_trylock(&dev->sem))
+    return;
+
+  xa_for_each(&dev->pages, index, node)
+  {
+    asgn1_walk_yield(dev, &seen);
+    if (!mutex_trylock(asgn1_page_lock(dev, index)))
+      continue;
+    asgn1_dedup_page(dev, index);
+    mutex_unlock(asgn1_page_lock(dev, index));
+    cond_resched();
+  }
+
+  up_read(&dev->sem);
+
+  hash_for_each_safe(asgn1_dedup_seen, bucket, tmp, entry, link)
+  {
+    hash_del(&entry->link);
+    kfree(entry);
+  }
+}
+
+/**
+ * The background dedup scan, run every dedup_secs while dedup is
+ * enabled. It is the only user of asgn1_dedup_seen.
+ */
+static void asgn1_dedup_work(struct work_struct *work)
+{
+  int i;
+
+  for (i = 0; i < asgn1_dev_count; i++)
+  {
+    asgn1_dedup_device(&asgn1_devices[i]);
+  }
+  schedule_delayed_work(&asgn1_deduper, dedup_secs * HZ);
+}
+
+/**
+ * Open the backing file of device number, creating it if needed, and
+ * index the pages it holds. Only the header is read: each page stays on
+ * file until it is first touched, so loading the module does not wait
+ * for the data. On failure the device is left empty and without a file.
+ */
+static int asgn1_restore(asgn1_dev *dev, int number)
+{
+  struct asgn1_backing_header hdr;
+  struct file *file;
+  loff_t pos = 0, data, hole, size;
+  unsigned long index, end;
+  page_node *node;
+  char *path;
+  ssize_t ret;
+  int err = 0;
+
+  if (asgn1_dev_count == 1)
+    path = kasprintf(GFP_KERNEL, "%s", backing_file);
+  else
+    path = kasprintf(GFP_KERNEL, "%s.%d", backing_file, number);
+  if (!path)
+    return -ENOMEM;
+
+  file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+  kfree(path);
+  if (IS_ERR(file))
+    return PTR_ERR(file);
+
+  ret = kernel_read(file, &hdr, sizeof(hdr), &pos);
+  if (ret == 0)
+  {
+    /* a new file */
+    dev->backing = file;
+    return 0;
+  }
+  if (ret != sizeof(hdr) || hdr.magic != ASGN1_BACKING_MAGIC ||
+      hdr.page_size != PAGE_SIZE || hdr.data_size > ASGN1_MAX_BYTES)
+  {
+    printk(KERN_WARNING "%s: %pD is not a backing file\n", MYDEV_NAME, file);
+    fput(file);
+    return -EINVAL;
+  }
+  dev->backing = file;
+
+  /* every page-sized run of data after the header is an on-file page */
+  size = i_size_read(file_inode(file));
+  for (data = PAGE_SIZE; data < size && !err; data = hole)
+  {
+    data = vfs_llseek(file, data, SEEK_DATA);
+    if (data < 0)
+      break; /* no more data */
+    hole = vfs_llseek(file, data, SEEK_HOLE);
+    if (hole < 0)
+    {
+      err = hole;
+      break;
+    }
+
+    end = min_t(loff_t, (hole + PAGE_SIZE - 1) >> PAGE_SHIFT, INT_MAX);
+    for (index = data >> PAGE_SHIFT; index < end; index++)
+    {
+      node = kmem_cache_alloc(asgn1_cache, GFP_KERNEL);
+      if (!node)
+      {
+        err = -ENOMEM;
+        break;
+      }
+      asgn1_init_node(node, NULL);
+
+      /* the first page of a run may end the previous one */
+      err = xa_insert(&dev->pages, index - 1, node, GFP_KERNEL);
+      if (err)
+      {
+        kmem_cache_free(asgn1_cache, node);
+        if (err != -EBUSY)
+          break;
+        err = 0;
+        continue;
+      }
+      atomic_inc(&dev->num_pages);
+    }
+  }
+
+  if (err)
+  {
+    printk(KERN_WARNING "%s: can't restore from %pD\n", MYDEV_NAME, file);
+    free_memory_pages(dev);
+    dev->backing = NULL;
+    fput(file);
+    return err;
+  }
+
+  atomic_long_set(&dev->data_size, hdr.data_size);
+  return 0;
+}
+
+/**
+ * Write nr pages from bvec to the backing file, starting with device page
+ * first.
+ */
+static int asgn1_write_backing(struct file *file, struct bio_vec *bvec,
+                               int nr, unsigned long first)
+{
+  loff_t pos = ((loff_t)first + 1) << PAGE_SHIFT;
+  size_t len = (size_t)nr << PAGE_SHIFT;
+  struct iov_iter iter;
+  ssize_t ret;
+
+  if (nr == 0)
+    return 0;
+
+  iov_iter_bvec(&iter, ITER_SOURCE, bvec, nr, len);
+  ret = vfs_iter_write(file, &iter, &pos, 0);
+  if (ret < 0)
+    return ret;
+  return ret == len ? 0 : -EIO;
+}
+
+/**
+ * Make device pages first to end - 1 a hole in the backing file. Where
+ * the file system can't punch holes, the range is written with zeros, so
+ * old data there does not come back.
+ */
+static int asgn1_hole_backing(struct file *file, unsigned long first,
+                              unsigned long end)
+{
+  struct bio_vec zero;
+  int err;
+
+  err = vfs_fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      ((loff_t)first + 1) << PAGE_SHIFT,
+                      (loff_t)(end - first) << PAGE_SHIFT);
+  if (err != -EOPNOTSUPP)
+    return err;
+
+  bvec_set_page(&zero, ZERO_PAGE(0), PAGE_SIZE, 0);
+  for (; first < end && !err; first++)
+  {
+    err = asgn1_write_backing(file, &zero, 1, first);
+  }
+  return err;
+}
+
+/**
+ * Rewrite the header of the backing file of dev with its data size.
+ */
+static int asgn1_write_header(asgn1_dev *dev)
+{
+  struct asgn1_backing_header hdr = {
+      .magic = ASGN1_BACKING_MAGIC,
+      .page_size = PAGE_SIZE,
+      .data_size = atomic_long_read(&dev->data_size),
+  };
+  loff_t pos = 0;
+
+  if (kernel_write(dev->backing, &hdr, sizeof(hdr), &pos) != sizeof(hdr))
+    return -EIO;
+  return 0;
+}
+
+/**
+ * Before the backing file of dev changes under pages first to last, read
+ * in any of them that its snapshot slot still has on file, so the
+ * snapshot keeps the old data.
+ */
+static void asgn1_preserve_snapshot(asgn1_dev *dev, unsigned long first,
+                                    unsigned long last)
+{
+  asgn1_dev *slot = dev->snapshot;
+  unsigned long index;
+  struct page *page;
+  page_node *node;
+  bool on_file;
+
+  if (!slot)
+    return;
+
+  xa_for_each_range(&slot->pages, index, node, first, last)
+  {
+    /* look again under the lock; the slot may be replaced meanwhile */
+    xa_lock(&slot->pages);
+    node = xa_load(&slot->pages, index);
+    on_file = node && !node->page && !node->zdata;
+    xa_unlock(&slot->pages);
+    if (!on_file)
+      continue;
+
+    page = asgn1_load_page(slot, index);
+    if (!IS_ERR_OR_NULL(page))
+      put_page(page);
+  }
+}
+
+/**
+ * Write a run of nr dirty pages from bvec, starting with page first, and
+ * drop our references. Pages that failed, or that are mapped and so may
+ * change without a fault, are left dirty.
+ */
+static int asgn1_flush_run(asgn1_dev *dev, struct bio_vec *bvec, int nr,
+                           unsigned long first)
+{
+  int err = asgn1_write_backing(dev->backing, bvec, nr, first);
+  int i;
+
+  for (i = 0; i < nr; i++)
+  {
+    if (err || page_mapped(bvec[i].bv_page))
+      asgn1_set_dirty(dev, first + i);
+    put_page(bvec[i].bv_page);
+  }
+  return err;
+}
+
+/**
+ * Write up to budget dirty pages of dev back to its backing file, in
+ * index order and in runs of up to ASGN1_CKPT_BATCH pages per call, then
+ * update the header. Each page's mark is cleared before it is read, so a
+ * write racing with the flush marks it again. Holding dev->sem shared
+ * keeps truncation from freeing pages that are about to be written.
+ */
+static int asgn1_flush(asgn1_dev *dev, long budget)
+{
+  unsigned long index, first = 0;
+  struct bio_vec *bvec;
+  struct page *page;
+  page_node *node;
+  u64 start = ktime_get_ns();
+  long done = 0;
+  int nr = 0;
+  int err = 0, ret;
+
+  bvec = kmalloc_array(ASGN1_CKPT_BATCH, sizeof(*bvec), GFP_KERNEL);
+  if (!bvec)
+    return -ENOMEM;
+
+  mutex_lock(&dev->flush_lock);
+  down_read(&dev->sem);
+  xa_for_each_marked(&dev->pages, index, node, ASGN1_MARK_DIRTY)
+  {
+    if (nr && (index != first + nr || nr == ASGN1_CKPT_BATCH))
+    {
+      err = asgn1_flush_run(dev, bvec, nr, first);
+      nr = 0;
+      if (err)
+        break;
+    }
+    if (done >= budget)
+      break;
+
+    /* hold the page before it is clean, so it can't be evicted before
+       it is written */
+    asgn1_preserve_snapshot(dev, index, index);
+    page = asgn1_get_page_ref(dev, index);
+    if (IS_ERR(page))
+    {
+      err = PTR_ERR(page);
+      break;
+    }
+    if (!page)
+      continue;
+    if (!asgn1_clear_dirty(dev, index))
+    {
+      put_page(page);
+      continue;
+    }
+
+    if (nr == 0)
+      first = index;
+    bvec_set_page(&bvec[nr++], page, PAGE_SIZE, 0);
+    done++;
+  }
+  ret = asgn1_flush_run(dev, bvec, nr, first);
+  if (!err)
+    err = ret;
+  if (!err)
+    err = asgn1_write_header(dev);
+  up_read(&dev->sem);
+  mutex_unlock(&dev->flush_lock);
+  kfree(bvec);
+
+  atomic_long_add(done, &dev->flushed);
+  atomic64_add(ktime_get_ns() - start, &dev->flush_ns);
+  if (err)
+  {
+    WRITE_ONCE(dev->flush_err, err);
+    printk_ratelimited(KERN_WARNING "%s: write-back of %s failed (%d)\n",
+                       MYDEV_NAME, dev_name(dev->device), err);
+  }
+  return err;
+}
+
+/**
+ * The write-behind worker of a device. Each run writes back at most what
+ * flush_kbps allows for one writeback_ms interval, and runs again after
+ * another interval while pages are still dirty.
+ */
+static void asgn1_flush_work(struct work_struct *work)
+{
+  asgn1_dev *dev = container_of(to_delayed_work(work), asgn1_dev, flush_work);
+  int delay = READ_ONCE(writeback_ms);
+  int kbps = READ_ONCE(flush_kbps);
+  long budget = LONG_MAX;
+
+  if (kbps > 0 && delay > 0)
+  {
+    budget = max(1L, (long)kbps * delay / 1000 / (PAGE_SIZE >> 10));
+  }
+
+  asgn1_flush(dev, budget);
+
+  if (delay > 0 && atomic_read(&dev->dirty) > 0)
+  {
+    queue_delayed_work(asgn1_wq, &dev->flush_work, msecs_to_jiffies(delay));
+  }
+}
+
+/**
+ * In write-behind mode, make device pages first to end - 1 a hole in the
+ * backing file as soon as they are freed, so a crash can't bring them
+ * back. Otherwise that waits for unload. The caller holds dev->sem for
+ * writing.
+ */
+static void asgn1_discard_backing(asgn1_dev *dev, unsigned long first,
+                                  unsigned long end)
+{
+  loff_t size;
+  int err;
+
+  if (!dev->backing || READ_ONCE(writeback_ms) <= 0)
+    return;
+
+  asgn1_preserve_snapshot(dev, first, end - 1);
+  if (end == ULONG_MAX)
+  {
+    size = ((loff_t)first + 1) << PAGE_SHIFT;
+    err = 0;
+    if (i_size_read(file_inode(dev->backing)) > size)
+      err = vfs_truncate(&dev->backing->f_path, size);
+  }
+  else
+  {
+    err = asgn1_hole_backing(dev->backing, first, end);
+  }
+
+  if (err)
+  {
+    WRITE_ONCE(dev->flush_err, err);
+  }
+}
+
+/**
+ * Write every dirty page to the backing file and flush it to disk. A
+ * device without a backing file has nothing to sync.
+ */
+static int asgn1_sync(asgn1_dev *dev, int datasync)
+{
+  int err;
+
+  if (!dev->backing)
+    return 0;
+
+  err = asgn1_flush(dev, LONG_MAX);
+  if (!err)
+    err = vfs_fsync(dev->backing, datasync);
+
+  /* report an earlier background failure once */
+  if (!err)
+    err = xchg(&dev->flush_err, 0);
+  return err;
+}
+
+static int asgn1_fsync(struct file *filp, loff_t start, loff_t end,
+                       int datasync)
+{
+  return asgn1_sync(filp->private_data, datasync);
+}
+
+/**
+ * Save dev to its backing file at unload: write back every dirty page,
+ * punch out the gaps between pages, and trim the file after the last
+ * one. Clean pages, and those never restored, are already in place.
+ * Nothing else can be using the device by now.
+ */
+static void asgn1_checkpoint(asgn1_dev *dev)
+{
+  struct file *file = dev->backing;
+  unsigned long index, next = 0;
+  page_node *node;
+  int err;
+
+  err = asgn1_flush(dev, LONG_MAX);
+
+  xa_for_each(&dev->pages, index, node)
+  {
+    if (err)
+      break;
+    if (index != next)
+      err = asgn1_hole_backing(file, next, index);
+    next = index + 1;
+  }
+
+  if (!err)
+    err = vfs_truncate(&file->f_path, ((loff_t)next + 1) << PAGE_SHIFT);
+  if (!err)
+    err = vfs_fsync(file, 0);
+
+  if (err)
+  {
+    printk(KERN_WARNING "%s: can't save %s to %pD (%d)\n", MYDEV_NAME,
+           dev_name(dev->device), file, err);
+  }
+}
+
+/**
+ * The mapping user mmaps of dev go through, for the block device to keep
+ * them coherent when it frees pages, or NULL if nobody has mapped dev.
+ */
+static struct address_space *asgn1_blk_mapping(asgn1_dev *dev)
+{
+  struct inode *inode = READ_ONCE(dev->mapped);
+
+  return inode ? inode->i_mapping : NULL;
+}
+
+/**
+ * Move the data of a read or write request between its bio segments and
+ * the page store, one multi-page segment at a time.
+ */
+static blk_status_t asgn1_blk_rw(asgn1_dev *dev, struct request *rq)
+{
+  bool write = op_is_write(req_op(rq));
+  loff_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+  struct req_iterator iter;
+  struct bio_vec bvec;
+  struct iov_iter i;
+  ssize_t ret;
+
+  rq_for_each_bvec(bvec, rq, iter)
+  {
+    iov_iter_bvec(&i, write ? ITER_SOURCE : ITER_DEST, &bvec, 1, bvec.bv_len);
+    if (write)
+    {
+      ret = asgn1_write_pages(dev, asgn1_blk_mapping(dev), &pos, &i, false);
+    }
+    else
+    {
+      down_read(&dev->sem);
+      ret = asgn1_read_pages(dev, pos, bvec.bv_len, &i);
+      up_read(&dev->sem);
+    }
+    if (ret < 0)
+      return errno_to_blk_status(ret);
+    if (ret < bvec.bv_len)
+      return BLK_STS_IOERR;
+    pos += ret;
+  }
+  return BLK_STS_OK;
+}
+
+/**
+ * Serve one block request from the page store, in process context: the
+ * queues are BLK_MQ_F_BLOCKING, so this may sleep on dev->sem and
+ * allocate pages just like write(). Discards and zeroing free the pages,
+ * which then read back as zeros.
+ */
+static blk_status_t asgn1_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                   const struct blk_mq_queue_data *bd)
+{
+  asgn1_dev *dev = hctx->queue->queuedata;
+  struct request *rq = bd->rq;
+  u64 start = ktime_get_ns();
+  blk_status_t status;
+
+  blk_mq_start_request(rq);
+  switch (req_op(rq))
+  {
+  case REQ_OP_READ:
+    status = asgn1_blk_rw(dev, rq);
+    asgn1_count(dev, ASGN1_STAT_READS, 1);
+    asgn1_count(dev, ASGN1_STAT_READ_BYTES, blk_rq_bytes(rq));
+    asgn1_time(dev, ASGN1_LAT_READ, ktime_get_ns() - start);
+    break;
+  case REQ_OP_WRITE:
+    status = asgn1_blk_rw(dev, rq);
+    asgn1_count(dev, ASGN1_STAT_WRITES, 1);
+    asgn1_count(dev, ASGN1_STAT_WRITE_BYTES, blk_rq_bytes(rq));
+    asgn1_time(dev, ASGN1_LAT_WRITE, ktime_get_ns() - start);
+    break;
+  case REQ_OP_DISCARD:
+  case REQ_OP_WRITE_ZEROES:
+    asgn1_punch_hole(dev, asgn1_blk_mapping(dev),
+                     blk_rq_pos(rq) << SECTOR_SHIFT, blk_rq_bytes(rq));
+    status = BLK_STS_OK;
+    break;
+  case REQ_OP_FLUSH:
+    status = errno_to_blk_status(asgn1_sync(dev, 0));
+    break;
+  default:
+    status = BLK_STS_NOTSUPP;
+    break;
+  }
+  blk_mq_end_request(rq, status);
+  return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops asgn1_mq_ops = {
+    .queue_rq = asgn1_queue_rq,
+};
+
+static const struct block_device_operations asgn1_blk_fops = {
+    .owner = THIS_MODULE,
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+/**
+ * Queue limits were set one at a time after allocating the disk
+ * before 6.9.
+ */
+static struct gendisk *asgn1_alloc_disk(struct blk_mq_tag_set *set,
+                                        struct queue_limits *lim, void *data)
+{
+  struct gendisk *disk = blk_mq_alloc_disk(set, data);
+
+  if (IS_ERR(disk))
+    return disk;
+  blk_queue_physical_block_size(disk->queue, lim->physical_block_size);
+  blk_queue_max_discard_sectors(disk->queue, lim->max_hw_discard_sectors);
+  blk_queue_max_write_zeroes_sectors(disk->queue,
+                                     lim->max_write_zeroes_sectors);
+  disk->queue->limits.discard_granularity = lim->discard_granularity;
+  return disk;
+}
+#else
+#define asgn1_alloc_disk blk_mq_alloc_disk
+#endif
+
+/**
+ * Add a block device of blkdev_mb MiB over the page store of dev, with one
+ * hardware queue per CPU. It is named asgn1b<number> and shares pages,
+ * limits and the backing file with the character device, so the two
+ * always see the same data. With a backing file it advertises a volatile
+ * write cache, so filesystems send the flushes that write it back.
+ */
+static int asgn1_blk_setup(asgn1_dev *dev, int number)
+{
+  struct queue_limits lim = {
+      .physical_block_size = PAGE_SIZE,
+      .max_hw_discard_sectors = UINT_MAX,
+      .max_write_zeroes_sectors = UINT_MAX,
+      .discard_granularity = PAGE_SIZE,
+  };
+  struct gendisk *disk;
+  int result;
+
+  /* with a backing file, writes are cached until flushed to it */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+  if (dev->backing)
+    lim.features |= BLK_FEAT_WRITE_CACHE;
+#endif
+
+  dev->tag_set.ops = &asgn1_mq_ops;
+  dev->tag_set.nr_hw_queues = nr_cpu_ids;
+  dev->tag_set.queue_depth = ASGN1_BLK_QUEUE_DEPTH;
+  dev->tag_set.numa_node = NUMA_NO_NODE;
+  dev->tag_set.flags = ASGN1_BLK_FLAGS;
+  result = blk_mq_alloc_tag_set(&dev->tag_set);
+  if (result)
+    return result;
+
+  disk = asgn1_alloc_disk(&dev->tag_set, &lim, dev);
+  if (IS_ERR(disk))
+  {
+    result = PTR_ERR(disk);
+    goto fail_disk;
+  }
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+  blk_queue_flag_set(QUEUE_FLAG_NONROT, disk->queue);
+  if (dev->backing)
+    blk_queue_write_cache(disk->queue, true, false);
+#endif
+
+  disk->fops = &asgn1_blk_fops;
+  disk->private_data = dev;
+  snprintf(disk->disk_name, DISK_NAME_LEN, "%sb%d", MYDEV_NAME, number);
+  set_capacity(disk, (sector_t)blkdev_mb << (20 - SECTOR_SHIFT));
+
+  dev->disk = disk;
+  result = add_disk(disk);
+  if (result)
+  {
+    dev->disk = NULL;
+    put_disk(disk);
+    goto fail_disk;
+  }
+  return 0;
+
+fail_disk:
+  blk_mq_free_tag_set(&dev->tag_set);
+  return result;
+}
+
+/**
+ * Remove the block device of dev, if it has one.
+ */
+static void asgn1_blk_teardown(asgn1_dev *dev)
+{
+  if (!dev->disk)
+    return;
+
+  del_gendisk(dev->disk);
+  put_disk(dev->disk);
+  blk_mq_free_tag_set(&dev->tag_set);
+  dev->disk = NULL;
+  if (dev->mapped)
+  {
+    iput(dev->mapped);
+    dev->mapped = NULL;
+  }
+}
+
+static void *my_seq_start(struct seq_file *s, loff_t *pos)
+{
+  if (*pos >= asgn1_nr_devs)
+    return NULL;
+  else
+    return &asgn1_devices[*pos];
+}
+
+static void *my_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+  (*pos)++;
+  if (*pos >= asgn1_nr_devs)
+    return NULL;
+  else
+    return &asgn1_devices[*pos];
+}
+
+static void my_seq_stop(struct seq_file *s, void *v)
+{
+  /* There's nothing to do here! */
+}
+
+/**
+ * Print the placement policy and how many of the device's pages are on
+ * each node with memory. A node's page only changes under the xa_lock,
+ * so the index is walked under it, dropped every batch so a busy device
+ * is not held up for long; a page shared by dedup counts once however
+ * many nodes share it.
+ */
+static void asgn1_numa_show(struct seq_file *s, asgn1_dev *dev)
+{
+  XA_STATE(xas, &dev->pages, 0);
+  unsigned long share;
+  struct page *page;
+  page_node *node;
+  u64 *counts;
+  int nid, seen = 0;
 
-  /* Now write the data page by page without additional allocations */
-  for (curr_page_no = begin_page_no; curr_page_no <= end_page_no && size_written < count; curr_page_no++)
-  {
-    struct page *page = get_page_by_index(curr_page_no);
-    void *page_addr;
+  seq_printf(s, "NUMA policy: %s", asgn1_numa_names[asgn1_numa]);
+  if (asgn1_numa == ASGN1_NUMA_BIND)
+    seq_printf(s, " (node %d)", numa_node);
+  seq_putc(s, '\n');
 
-    if (!page)
-      break;
+  counts = kcalloc(nr_node_ids, sizeof(*counts), GFP_KERNEL);
+  if (!counts)
+    return;
 
-    /* Calculate offset within page */
-    if (curr_page_no == begin_page_no)
-    {
-      begin_offset = *f_pos % PAGE_SIZE;
-    }
-    else
+  xas_lock(&xas);
+  xas_for_each(&xas, node, ULONG_MAX)
+  {
+    page = node->page;
+    if (page)
     {
-      begin_offset = 0;
+      share = max(READ_ONCE(page->private), 1UL);
+      counts[page_to_nid(page)] += div64_ul(ASGN1_SHARE_UNIT, share);
     }
 
-    /* Calculate size to write to this page */
-    size_to_be_written = min(count - size_written, PAGE_SIZE - begin_offset);
-
-    if (size_to_be_written <= 0)
-      break;
-
-    /* Map page and copy from user */
-    page_addr = kmap_local_page(page);
-    curr_size_written = size_to_be_written - copy_from_user(page_addr + begin_offset,
-                                                            buf + size_written,
-                                                            size_to_be_written);
-    kunmap_local(page_addr);
-
-    if (curr_size_written < size_to_be_written)
+    if (++seen % ASGN1_WALK_BATCH == 0)
     {
-      if (size_written + curr_size_written == 0)
-      {
-        return -EINVAL; /* completely failed */
-      }
-      size_written += curr_size_written;
-      break; /* partial copy, return what we wrote */
+      xas_pause(&xas);
+      xas_unlock(&xas);
+      cond_resched();
+      xas_lock(&xas);
     }
-
-    size_written += curr_size_written;
   }
+  xas_unlock(&xas);
 
-  *f_pos += size_written;
-  asgn1_device.data_size = max(asgn1_device.data_size, orig_f_pos + size_written);
-  return size_written;
+  seq_puts(s, "Pages per node:");
+  for_each_node_state(nid, N_MEMORY)
+  {
+    seq_printf(s, " %d=%llu", nid,
+               (counts[nid] + ASGN1_SHARE_UNIT / 2) / ASGN1_SHARE_UNIT);
+  }
+  seq_putc(s, '\n');
+  kfree(counts);
 }
 
-#define SET_NPROC_OP 1
-#define TEM_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int)
-
-/**
- * The ioctl function, which nothing needs to be done in this case.
- */
-long asgn1_ioctl(struct file *, unsigned, unsigned long);
-long asgn1_ioctl(struct file *filp, unsigned cmd, unsigned long arg)
+int my_seq_show(struct seq_file *, void *);
+int my_seq_show(struct seq_file *s, void *v)
 {
-  int nr;
-  int new_nprocs;
+  asgn1_dev *dev = v;
+  asgn1_stats *sum;
+  int i;
 
-  /* check whether cmd is for our device, if not for us, return -EINVAL */
-  if (_IOC_TYPE(cmd) != MYIOC_TYPE)
+  /* use seq_printf to print some info to s */
+  seq_printf(s, "Device: %s\n", dev_name(dev->device));
+  if (dev->origin)
   {
-    return -EINVAL;
+    seq_printf(s, "%s of: %s\n", dev->readonly ? "Snapshot" : "Clone",
+               dev_name(dev->origin->device));
   }
+  seq_printf(s, "Major: %d\n", MAJOR(dev->dev));
+  seq_printf(s, "Minor: %d\n", MINOR(dev->dev));
+  seq_printf(s, "Number of pages: %d\n", atomic_read(&dev->num_pages));
+  seq_printf(s, "Page limit: %d\n", dev->max_pages);
+  seq_printf(s, "Resident pages: %d (limit %ld)\n",
+             atomic_read(&dev->resident), READ_ONCE(dev->mem_limit));
+  seq_printf(s, "Evicted pages: %ld (%ld by the shrinker)\n",
+             atomic_long_read(&dev->evicted), atomic_long_read(&dev->reclaimed));
+  seq_printf(s, "Pool pages: %d (max %d)\n", READ_ONCE(dev->pool_pages),
+             READ_ONCE(dev->pool_max));
+  asgn1_numa_show(s, dev);
+  if (extent_order)
+  {
+    int extents = atomic_read(&dev->extents);
+    int fallbacks = atomic_read(&dev->extent_fallbacks);
 
-  /* get command, and if command is SET_NPROC_OP, then get the data */
-  nr = _IOC_NR(cmd);
+    seq_printf(s, "Extents: %d of %lu KiB\n", extents,
+               (PAGE_SIZE << extent_order) >> 10);
+    seq_printf(s, "Extent fallbacks: %d (%d%%)\n", fallbacks,
+               extents + fallbacks ? fallbacks * 100 / (extents + fallbacks) : 0);
+  }
+  if (asgn1_zbuf)
+  {
+    int zpages = atomic_read(&dev->zpages);
+    long zbytes = atomic_long_read(&dev->zbytes);
+    long ratio = zbytes ? ((long)zpages << PAGE_SHIFT) * 100 / zbytes : 0;
 
-  if (nr == SET_NPROC_OP)
+    seq_printf(s, "Compressed pages: %d\n", zpages);
+    seq_printf(s, "Compressed bytes: %ld (ratio %ld.%02ld)\n", zbytes,
+               ratio / 100, ratio % 100);
+    asgn1_hist_show(s, "Decompression", &dev->zlat);
+  }
+  if (dev == asgn1_devices &&
+      (dedup_secs > 0 || atomic_long_read(&asgn1_shared_saved)))
   {
-    if (copy_from_user(&new_nprocs, (int __user *)arg, sizeof(int)))
-    {
-      return -EFAULT;
-    }
+    /* shared pages can span devices, so this is for all of them */
+    long saved = atomic_long_read(&asgn1_shared_saved);
+    long resident = 0, ratio;
 
-    /* check validity of the value before setting max_nprocs */
-    if (new_nprocs <= 0)
+    for (i = 0; i < asgn1_nr_devs; i++)
     {
-      return -EINVAL;
+      resident += atomic_read(&asgn1_devices[i].num_pages) -
+                  atomic_read(&asgn1_devices[i].zpages);
     }
+    ratio = resident > saved ? resident * 100 / (resident - saved) : 100;
 
-    atomic_set(&asgn1_device.max_nprocs, new_nprocs);
-    return 0;
+    seq_printf(s, "Dedup pages saved, all devices: %ld (%lu KiB)\n", saved,
+               (unsigned long)saved << (PAGE_SHIFT - 10));
+    seq_printf(s, "Dedup ratio, all devices: %ld.%02ld\n", ratio / 100,
+               ratio % 100);
   }
+  if (dev->backing)
+  {
+    long flushed = atomic_long_read(&dev->flushed);
+    u64 ms = div_u64(atomic64_read(&dev->flush_ns), NSEC_PER_MSEC);
 
-  return -ENOTTY;
-}
-
-static int asgn1_mmap(struct file *, struct vm_area_struct *);
-static int asgn1_mmap(struct file *filp, struct vm_area_struct *vma)
-{
-  unsigned long pfn;
-  unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
-  unsigned long len = vma->vm_end - vma->vm_start;
-  unsigned long ramdisk_size = asgn1_device.num_pages * PAGE_SIZE;
-  page_node *curr;
-  unsigned long index = 0;
-
-  /* check offset and len */
-  if (offset + len > ramdisk_size)
+    seq_printf(s, "Restored pages: %d\n", atomic_read(&dev->restored));
+    seq_printf(s, "Dirty pages: %d\n", atomic_read(&dev->dirty));
+    seq_printf(s, "Written back: %ld pages (%llu KiB/s)\n", flushed,
+               ms ? div64_u64((u64)flushed * (PAGE_SIZE >> 10) * 1000, ms) : 0);
+    seq_printf(s, "Write-back every %d ms, dirty ratio %d%%/%d%%, "
+               "limit %d KiB/s\n", READ_ONCE(writeback_ms),
+               READ_ONCE(dirty_background_ratio), READ_ONCE(dirty_ratio),
+               READ_ONCE(flush_kbps));
+  }
+  seq_printf(s, "Data size: %ld bytes\n", atomic_long_read(&dev->data_size));
+  if (dev->disk)
   {
-    return -EINVAL;
+    seq_printf(s, "Block device: %s (%d MiB)\n", dev->disk->disk_name,
+               blkdev_mb);
+  }
+  if (dev->ring)
+  {
+    seq_printf(s, "Ring: %zu KiB, head %llu, tail %llu\n",
+               dev->ring_size >> 10, READ_ONCE(dev->ring_ctl->head),
+               READ_ONCE(dev->ring_ctl->tail));
   }
+  seq_printf(s, "Current processes: %d\n", atomic_read(&dev->nprocs));
+  seq_printf(s, "Max processes: %d\n", atomic_read(&dev->max_nprocs));
 
-  /* loop through the entire page list, once the first requested page
-     reached, add each page with remap_pfn_range one by one
-     up to the last requested page */
-  list_for_each_entry(curr, &asgn1_device.mem_list, list)
+  sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+  if (sum)
   {
-    if (index >= vma->vm_pgoff)
+    asgn1_stats_sum(dev, sum);
+    seq_printf(s, "Reads: %llu (%llu bytes)\n", sum->count[ASGN1_STAT_READS],
+               sum->count[ASGN1_STAT_READ_BYTES]);
+    seq_printf(s, "Writes: %llu (%llu bytes)\n", sum->count[ASGN1_STAT_WRITES],
+               sum->count[ASGN1_STAT_WRITE_BYTES]);
+    seq_printf(s, "Faults: %llu\n", sum->count[ASGN1_STAT_FAULTS]);
+    seq_printf(s, "Page allocations: %llu (%llu failed)\n",
+               sum->count[ASGN1_STAT_ALLOCS],
+               sum->count[ASGN1_STAT_ALLOC_FAILS]);
+    seq_printf(s, "Busy rejections: %llu\n", sum->count[ASGN1_STAT_BUSY]);
+    seq_printf(s, "NUMA accesses: %llu local, %llu remote\n",
+               sum->count[ASGN1_STAT_LOCAL], sum->count[ASGN1_STAT_REMOTE]);
+    for (i = 0; i < ASGN1_NR_LATS; i++)
     {
-      if ((index - vma->vm_pgoff) * PAGE_SIZE >= len)
-      {
-        break;
-      }
-
-      pfn = page_to_pfn(curr->page);
-      if (remap_pfn_range(vma,
-                          vma->vm_start + (index - vma->vm_pgoff) * PAGE_SIZE,
-                          pfn,
-                          PAGE_SIZE,
-                          vma->vm_page_prot))
-      {
-        return -EAGAIN;
-      }
+      asgn1_hist_print(s, asgn1_lat_names[i], sum->lat[i]);
     }
-    index++;
+    kfree(sum);
   }
-
+  seq_putc(s, '\n');
   return 0;
 }
 
-struct file_operations asgn1_fops = {
-    .owner = THIS_MODULE,
-    .read = asgn1_read,
-    .write = asgn1_write,
-    .unlocked_ioctl = asgn1_ioctl,
-    .open = asgn1_open,
-    .mmap = asgn1_mmap,
-    .release = asgn1_release,
-    .llseek = asgn1_lseek};
-
-static void *my_seq_start(struct seq_file *s, loff_t *pos)
+/**
+ * /proc/asgn1_stats: the statistics of every device in a form meant for
+ * scripts, one "<device> <name> <value>" line per counter, and one
+ * "<device> <op>_lat_ns <bucket floor> <count>" line per non-empty
+ * latency bucket.
+ */
+static int asgn1_stats_show(struct seq_file *s, void *v)
 {
-  if (*pos >= 1)
-    return NULL;
-  else
-    return &asgn1_dev_count + *pos;
-}
+  asgn1_stats *sum;
+  const char *name;
+  int d, i, j;
 
-static void *my_seq_next(struct seq_file *s, void *v, loff_t *pos)
-{
-  (*pos)++;
-  if (*pos >= 1)
-    return NULL;
-  else
-    return &asgn1_dev_count + *pos;
-}
+  sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+  if (!sum)
+    return -ENOMEM;
 
-static void my_seq_stop(struct seq_file *s, void *v)
-{
-  /* There's nothing to do here! */
-}
+  for (d = 0; d < asgn1_nr_devs; d++)
+  {
+    name = dev_name(asgn1_devices[d].device);
+    asgn1_stats_sum(&asgn1_devices[d], sum);
+    for (i = 0; i < ASGN1_NR_STATS; i++)
+    {
+      seq_printf(s, "%s %s %llu\n", name, asgn1_stat_keys[i], sum->count[i]);
+    }
+    for (i = 0; i < ASGN1_NR_LATS; i++)
+    {
+      for (j = 0; j < ASGN1_HIST_BUCKETS; j++)
+      {
+        if (sum->lat[i][j])
+          seq_printf(s, "%s %s_lat_ns %llu %llu\n", name, asgn1_lat_keys[i],
+                     1ULL << j, sum->lat[i][j]);
+      }
+    }
+  }
 
-int my_seq_show(struct seq_file *, void *);
-int my_seq_show(struct seq_file *s, void *v)
-{
-  /* use seq_printf to print some info to s */
-  seq_printf(s, "Device: %s\n", MYDEV_NAME);
-  seq_printf(s, "Major: %d\n", MAJOR(asgn1_device.dev));
-  seq_printf(s, "Minor: %d\n", MINOR(asgn1_device.dev));
-  seq_printf(s, "Number of pages: %d\n", asgn1_device.num_pages);
-  seq_printf(s, "Data size: %zu bytes\n", asgn1_device.data_size);
-  seq_printf(s, "Current processes: %d\n", atomic_read(&asgn1_device.nprocs));
-  seq_printf(s, "Max processes: %d\n", atomic_read(&asgn1_device.max_nprocs));
+  kfree(sum);
   return 0;
 }
 
@@ -551,103 +4790,369 @@ static struct proc_ops asgn1_proc_ops = {
 };
 
 /**
- * Initialise the module and create the master device
+ * Initialise the state of one device and register its cdev and udev node.
+ * A single device keeps the historical /dev/asgn1 name; with more than
+ * one, they are named asgn1_0 .. asgn1_<n-1>. Indexes from asgn1_dev_count
+ * on are snapshot slots, named after their device with a _snap suffix,
+ * and start out as empty snapshots.
+ */
+static int asgn1_setup_device(asgn1_dev *dev, int index)
+{
+  int slot = index >= asgn1_dev_count;
+  int number = index % asgn1_dev_count;
+  int result;
+  int i;
+
+  dev->dev = MKDEV(asgn1_major, asgn1_minor + index);
+
+  /* set nprocs and max_nprocs of the device */
+  atomic_set(&dev->nprocs, 0);
+  atomic_set(&dev->max_nprocs, 1);
+  spin_lock_init(&dev->open_lock);
+  INIT_LIST_HEAD(&dev->open_queue);
+  init_waitqueue_head(&dev->open_wait);
+  init_waitqueue_head(&dev->data_wait);
+
+  /* initialize the page index and its locks */
+  xa_init(&dev->pages);
+  atomic_set(&dev->num_pages, 0);
+  atomic_long_set(&dev->data_size, 0);
+  init_rwsem(&dev->sem);
+  for (i = 0; i < ASGN1_PAGE_LOCKS; i++)
+  {
+    mutex_init(&dev->page_locks[i]);
+  }
+
+  /* the pool of recycled pages */
+  INIT_LIST_HEAD(&dev->pool);
+  spin_lock_init(&dev->pool_lock);
+  dev->pool_pages = 0;
+  dev->pool_max = max(pool_pages, 0);
+
+  atomic_set(&dev->extents, 0);
+  atomic_set(&dev->extent_fallbacks, 0);
+
+  /* compressed page state */
+  mutex_init(&dev->zlock);
+  atomic_set(&dev->zpages, 0);
+  atomic_long_set(&dev->zbytes, 0);
+  atomic_set(&dev->restored, 0);
+
+  /* write-behind */
+  atomic_set(&dev->dirty, 0);
+  mutex_init(&dev->flush_lock);
+  INIT_DELAYED_WORK(&dev->flush_work, asgn1_flush_work);
+  atomic_long_set(&dev->flushed, 0);
+  atomic64_set(&dev->flush_ns, 0);
+
+  if (number < size_limit_mb_count && size_limit_mb[number] > 0)
+  {
+    dev->max_pages = size_limit_mb[number] << (20 - PAGE_SHIFT);
+  }
+
+  /* memory limit and eviction */
+  atomic_set(&dev->resident, 0);
+  dev->clock_hand = 0;
+  atomic_long_set(&dev->evicted, 0);
+  atomic_long_set(&dev->reclaimed, 0);
+  if (!slot && number < mem_limit_mb_count && mem_limit_mb[number] > 0)
+  {
+    dev->mem_limit = (long)mem_limit_mb[number] << (20 - PAGE_SHIFT);
+  }
+
+  dev->stats = alloc_percpu(asgn1_stats);
+  if (!dev->stats)
+  {
+    printk(KERN_WARNING "%s: can't alloc statistics %d\n", MYDEV_NAME, index);
+    return -ENOMEM;
+  }
+
+  if (slot)
+  {
+    dev->origin = &asgn1_devices[number];
+    dev->origin->snapshot = dev;
+    dev->readonly = true;
+  }
+  else if (number < ring_kb_count && ring_kb[number] > 0)
+  {
+    result = asgn1_ring_setup(dev, ring_kb[number]);
+    if (result)
+    {
+      printk(KERN_WARNING "%s: can't allocate ring for device %d\n",
+             MYDEV_NAME, index);
+      goto fail_restore;
+    }
+  }
+  else if (backing_file)
+  {
+    result = asgn1_restore(dev, number);
+    if (result)
+    {
+      printk(KERN_WARNING "%s: can't open backing file for device %d\n",
+             MYDEV_NAME, index);
+      goto fail_restore;
+    }
+  }
+
+  /* set ops and owner field, and add cdev */
+  cdev_init(&dev->cdev, &asgn1_fops);
+  dev->cdev.owner = THIS_MODULE;
+  result = cdev_add(&dev->cdev, dev->dev, 1);
+  if (result)
+  {
+    printk(KERN_WARNING "%s: can't add cdev %d\n", MYDEV_NAME, index);
+    goto fail_cdev;
+  }
+
+  if (asgn1_dev_count == 1)
+  {
+    dev->device = device_create(asgn1_class, NULL, dev->dev, dev,
+                                "%s%s", MYDEV_NAME, slot ? "_snap" : "");
+  }
+  else
+  {
+    dev->device = device_create(asgn1_class, NULL, dev->dev, dev,
+                                "%s_%d%s", MYDEV_NAME, number,
+                                slot ? "_snap" : "");
+  }
+  if (IS_ERR(dev->device))
+  {
+    printk(KERN_WARNING "%s: can't create udev device %d\n", MYDEV_NAME, index);
+    result = PTR_ERR(dev->device);
+    cdev_del(&dev->cdev);
+    goto fail_cdev;
+  }
+
+  if (!slot && !dev->ring && blkdev_mb > 0)
+  {
+    result = asgn1_blk_setup(dev, number);
+    if (result)
+    {
+      printk(KERN_WARNING "%s: can't add block device %d\n", MYDEV_NAME,
+             index);
+      device_destroy(asgn1_class, dev->dev);
+      cdev_del(&dev->cdev);
+      goto fail_cdev;
+    }
+  }
+
+  return 0;
+
+  /* drop what was restored from the backing file */
+fail_cdev:
+  asgn1_ring_teardown(dev);
+  free_memory_pages(dev);
+  if (dev->backing)
+  {
+    fput(dev->backing);
+  }
+fail_restore:
+  free_percpu(dev->stats);
+  return result;
+}
+
+/**
+ * Remove one device and free all of its pages
+ */
+static void asgn1_teardown_device(asgn1_dev *dev)
+{
+  asgn1_blk_teardown(dev);
+  device_destroy(asgn1_class, dev->dev);
+  cdev_del(&dev->cdev);
+  cancel_delayed_work_sync(&dev->flush_work);
+
+  asgn1_ring_teardown(dev);
+  free_memory_pages(dev);
+  xa_destroy(&dev->pages);
+  if (dev->backing)
+  {
+    fput(dev->backing);
+  }
+  asgn1_set_pool_max(dev, 0);
+  free_percpu(dev->stats);
+}
+
+/**
+ * Initialise the module and create the devices
  */
 int __init asgn1_init_module(void);
 int __init asgn1_init_module(void)
 {
+  dev_t first;
   int result;
+  int i;
 
-  /* set nprocs and max_nprocs of the device */
-  atomic_set(&asgn1_device.nprocs, 0);
-  atomic_set(&asgn1_device.max_nprocs, 1);
+  if (asgn1_dev_count < 1 || asgn1_dev_count > ASGN1_MAX_DEVS)
+  {
+    printk(KERN_WARNING "%s: asgn1_dev_count must be 1..%d\n", MYDEV_NAME,
+           ASGN1_MAX_DEVS);
+    return -EINVAL;
+  }
+
+  if (dedup_secs > INT_MAX / HZ)
+  {
+    printk(KERN_WARNING "%s: dedup_secs is too large\n", MYDEV_NAME);
+    return -EINVAL;
+  }
+
+  if (extent_order < 0 || extent_order > ASGN1_MAX_EXTENT_ORDER)
+  {
+    printk(KERN_WARNING "%s: extent_order must be 0..%d\n", MYDEV_NAME,
+           ASGN1_MAX_EXTENT_ORDER);
+    return -EINVAL;
+  }
+
+  for (i = 0; i < ring_kb_count; i++)
+  {
+    if (ring_kb[i] < 0)
+    {
+      printk(KERN_WARNING "%s: ring_kb can't be negative\n", MYDEV_NAME);
+      return -EINVAL;
+    }
+  }
+
+  if (blkdev_mb < 0 || blkdev_mb > (ASGN1_MAX_BYTES >> 20))
+  {
+    printk(KERN_WARNING "%s: blkdev_mb must be 0..%lld\n", MYDEV_NAME,
+           ASGN1_MAX_BYTES >> 20);
+    return -EINVAL;
+  }
+
+  asgn1_numa = sysfs_match_string(asgn1_numa_names, numa_policy);
+  if (asgn1_numa < 0)
+  {
+    printk(KERN_WARNING "%s: numa_policy must be local, interleave or bind\n",
+           MYDEV_NAME);
+    return -EINVAL;
+  }
+  if (asgn1_numa == ASGN1_NUMA_BIND &&
+      (numa_node < 0 || numa_node >= nr_node_ids ||
+       !node_state(numa_node, N_MEMORY)))
+  {
+    printk(KERN_WARNING "%s: numa_node %d has no memory\n", MYDEV_NAME,
+           numa_node);
+    return -EINVAL;
+  }
+  atomic_set(&asgn1_numa_rotor, numa_node_id());
+
+  /* each device is followed by its snapshot slot */
+  asgn1_nr_devs = 2 * asgn1_dev_count;
 
   /* allocate major number */
-  result = alloc_chrdev_region(&asgn1_device.dev, asgn1_minor,
-                               asgn1_dev_count, MYDEV_NAME);
+  result = alloc_chrdev_region(&first, asgn1_minor,
+                               asgn1_nr_devs, MYDEV_NAME);
   if (result < 0)
   {
     printk(KERN_WARNING "%s: can't get major number\n", MYDEV_NAME);
     goto fail_device;
   }
-  asgn1_major = MAJOR(asgn1_device.dev);
+  asgn1_major = MAJOR(first);
 
-  /* allocate cdev, and set ops and owner field */
-  asgn1_device.cdev = cdev_alloc();
-  if (!asgn1_device.cdev)
+  asgn1_devices = kcalloc(asgn1_nr_devs, sizeof(asgn1_dev), GFP_KERNEL);
+  if (!asgn1_devices)
   {
-    printk(KERN_WARNING "%s: can't alloc cdev\n", MYDEV_NAME);
+    printk(KERN_WARNING "%s: can't alloc devices\n", MYDEV_NAME);
     result = -ENOMEM;
     goto fail_malloc;
   }
 
-  asgn1_device.cdev->ops = &asgn1_fops;
-  asgn1_device.cdev->owner = THIS_MODULE;
+  asgn1_cache = kmem_cache_create("asgn1_cache",
+                                  sizeof(page_node),
+                                  0,
+                                  SLAB_HWCACHE_ALIGN,
+                                  NULL);
+  if (!asgn1_cache)
+  {
+    printk(KERN_WARNING "%s: can't create cache\n", MYDEV_NAME);
+    result = -ENOMEM;
+    goto fail_kmem_cache;
+  }
 
-  /* add cdev */
-  result = cdev_add(asgn1_device.cdev, asgn1_device.dev, asgn1_dev_count);
+  result = asgn1_compress_init();
   if (result)
+    goto fail_compress;
+
+  if (backing_file)
   {
-    printk(KERN_WARNING "%s: can't add cdev\n", MYDEV_NAME);
-    goto fail_cdev;
+    asgn1_wq = alloc_workqueue("asgn1_flush", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    if (!asgn1_wq)
+    {
+      printk(KERN_WARNING "%s: can't create workqueue\n", MYDEV_NAME);
+      result = -ENOMEM;
+      goto fail_wq;
+    }
+  }
+
+  asgn1_class = class_create(MYDEV_NAME);
+  if (IS_ERR(asgn1_class))
+  {
+    printk(KERN_WARNING "%s: can't create class\n", MYDEV_NAME);
+    result = PTR_ERR(asgn1_class);
+    goto fail_class;
   }
 
-  /* initialize the page list */
-  INIT_LIST_HEAD(&asgn1_device.mem_list);
-  asgn1_device.num_pages = 0;
-  asgn1_device.data_size = 0;
+  for (i = 0; i < asgn1_nr_devs; i++)
+  {
+    result = asgn1_setup_device(&asgn1_devices[i], i);
+    if (result)
+      goto fail_device_create;
+  }
 
-  /* create proc entries */
-  asgn1_device.cache = kmem_cache_create("asgn1_cache",
-                                         sizeof(page_node),
-                                         0,
-                                         SLAB_HWCACHE_ALIGN,
-                                         NULL);
-  if (!asgn1_device.cache)
+  /* give clean and cached pages back under memory pressure */
+  asgn1_shrinker = shrinker_alloc(0, MYDEV_NAME);
+  if (!asgn1_shrinker)
   {
-    printk(KERN_WARNING "%s: can't create cache\n", MYDEV_NAME);
+    printk(KERN_WARNING "%s: can't allocate shrinker\n", MYDEV_NAME);
     result = -ENOMEM;
-    goto fail_kmem_cache;
+    goto fail_device_create;
   }
+  asgn1_shrinker->count_objects = asgn1_shrink_count;
+  asgn1_shrinker->scan_objects = asgn1_shrink_scan;
+  shrinker_register(asgn1_shrinker);
 
+  /* create proc entries */
   proc_create(MYDEV_NAME, 0, NULL, &asgn1_proc_ops);
+  proc_create_single(MYDEV_NAME "_stats", 0, NULL, asgn1_stats_show);
 
-  asgn1_device.class = class_create(MYDEV_NAME);
-  if (IS_ERR(asgn1_device.class))
+  /* start the compactor */
+  if (asgn1_zbuf)
   {
-    printk(KERN_WARNING "%s: can't create class\n", MYDEV_NAME);
-    result = PTR_ERR(asgn1_device.class);
-    goto fail_class;
+    INIT_DELAYED_WORK(&asgn1_compactor, asgn1_compact_work);
+    schedule_delayed_work(&asgn1_compactor, compress_secs * HZ);
   }
 
-  asgn1_device.device = device_create(asgn1_device.class, NULL,
-                                      asgn1_device.dev, NULL, "%s", MYDEV_NAME);
-  if (IS_ERR(asgn1_device.device))
+  /* start the dedup scan */
+  if (dedup_secs > 0)
   {
-    printk(KERN_WARNING "%s: can't create udev device\n", MYDEV_NAME);
-    result = PTR_ERR(asgn1_device.device);
-    goto fail_device_create;
+    INIT_DELAYED_WORK(&asgn1_deduper, asgn1_dedup_work);
+    schedule_delayed_work(&asgn1_deduper, dedup_secs * HZ);
   }
 
-  printk(KERN_WARNING "set up udev entry\n");
-  printk(KERN_WARNING "Hello world from %s\n", MYDEV_NAME);
+  printk(KERN_WARNING "set up udev entries\n");
+  printk(KERN_WARNING "Hello world from %s (%d devices)\n", MYDEV_NAME,
+         asgn1_dev_count);
   return 0;
 
   /* cleanup code called when any of the initialization steps fail */
 fail_device_create:
-  class_destroy(asgn1_device.class);
+  while (--i >= 0)
+  {
+    asgn1_teardown_device(&asgn1_devices[i]);
+  }
+  class_destroy(asgn1_class);
 fail_class:
-  remove_proc_entry(MYDEV_NAME, NULL);
-  if (asgn1_device.cache)
+  if (asgn1_wq)
   {
-    kmem_cache_destroy(asgn1_device.cache);
+    destroy_workqueue(asgn1_wq);
   }
+fail_wq:
+  asgn1_compress_exit();
+fail_compress:
+  kmem_cache_destroy(asgn1_cache);
 fail_kmem_cache:
-  cdev_del(asgn1_device.cdev);
-fail_cdev:
-  kfree(asgn1_device.cdev);
+  kfree(asgn1_devices);
 fail_malloc:
-  unregister_chrdev_region(asgn1_device.dev, asgn1_dev_count);
+  unregister_chrdev_region(first, asgn1_nr_devs);
 fail_device:
 
   return result;
@@ -659,22 +5164,47 @@ fail_device:
 void __exit asgn1_exit_module(void);
 void __exit asgn1_exit_module(void)
 {
-  device_destroy(asgn1_device.class, asgn1_device.dev);
-  class_destroy(asgn1_device.class);
-  printk(KERN_WARNING "cleaned up udev entry\n");
+  int i;
+
+  remove_proc_entry(MYDEV_NAME "_stats", NULL);
+  remove_proc_entry(MYDEV_NAME, NULL);
+  shrinker_free(asgn1_shrinker);
+
+  if (asgn1_zbuf)
+  {
+    cancel_delayed_work_sync(&asgn1_compactor);
+  }
+  if (dedup_secs > 0)
+  {
+    cancel_delayed_work_sync(&asgn1_deduper);
+  }
 
-  /* free all pages in the page list */
-  free_memory_pages();
+  /* save each device that has a backing file */
+  for (i = 0; i < asgn1_dev_count; i++)
+  {
+    if (asgn1_devices[i].backing)
+    {
+      asgn1_checkpoint(&asgn1_devices[i]);
+    }
+  }
+
+  /* remove each device and free all pages in its page index */
+  for (i = 0; i < asgn1_nr_devs; i++)
+  {
+    asgn1_teardown_device(&asgn1_devices[i]);
+  }
+  class_destroy(asgn1_class);
+  printk(KERN_WARNING "cleaned up udev entries\n");
 
   /* cleanup in reverse order */
-  remove_proc_entry(MYDEV_NAME, NULL);
-  if (asgn1_device.cache)
+  if (asgn1_wq)
   {
-    kmem_cache_destroy(asgn1_device.cache);
+    destroy_workqueue(asgn1_wq);
   }
-  cdev_del(asgn1_device.cdev);
-  kfree(asgn1_device.cdev);
-  unregister_chrdev_region(asgn1_device.dev, asgn1_dev_count);
+  asgn1_compress_exit();
+  kmem_cache_destroy(asgn1_cache);
+  kfree(asgn1_devices);
+  unregister_chrdev_region(MKDEV(asgn1_major, asgn1_minor), asgn1_nr_devs);
 
   printk(KERN_WARNING "Good bye from %s\n", MYDEV_NAME);
 }
@@ -0,0 +1,248 @@
+/**
+ * File: asgn1_trace.h
+ *
+ * Tracepoints on the asgn1 I/O path, under events/asgn1 in tracefs. They
+ * cost a patched-out branch while disabled.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM asgn1
+
+#if !defined(_ASGN1_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASGN1_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/kdev_t.h>
+
+TRACE_EVENT(asgn1_open,
+
+  TP_PROTO(dev_t dev, unsigned int flags, int nprocs, int ret),
+
+  TP_ARGS(dev, flags, nprocs, ret),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned int, flags)
+    __field(int, nprocs)
+    __field(int, ret)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->flags = flags;
+    __entry->nprocs = nprocs;
+    __entry->ret = ret;
+  ),
+
+  TP_printk("dev=%d:%d flags=0x%x nprocs=%d ret=%d",
+            MAJOR(__entry->dev), MINOR(__entry->dev), __entry->flags,
+            __entry->nprocs, __entry->ret)
+);
+
+TRACE_EVENT(asgn1_release,
+
+  TP_PROTO(dev_t dev, int nprocs),
+
+  TP_ARGS(dev, nprocs),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(int, nprocs)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->nprocs = nprocs;
+  ),
+
+  TP_printk("dev=%d:%d nprocs=%d",
+            MAJOR(__entry->dev), MINOR(__entry->dev), __entry->nprocs)
+);
+
+DECLARE_EVENT_CLASS(asgn1_rw,
+
+  TP_PROTO(dev_t dev, loff_t pos, size_t len, ssize_t ret, u64 ns),
+
+  TP_ARGS(dev, pos, len, ret, ns),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(loff_t, pos)
+    __field(size_t, len)
+    __field(ssize_t, ret)
+    __field(u64, ns)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->pos = pos;
+    __entry->len = len;
+    __entry->ret = ret;
+    __entry->ns = ns;
+  ),
+
+  TP_printk("dev=%d:%d pos=%lld len=%zu ret=%zd ns=%llu",
+            MAJOR(__entry->dev), MINOR(__entry->dev), __entry->pos,
+            __entry->len, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(asgn1_rw, asgn1_read,
+  TP_PROTO(dev_t dev, loff_t pos, size_t len, ssize_t ret, u64 ns),
+  TP_ARGS(dev, pos, len, ret, ns)
+);
+
+DEFINE_EVENT(asgn1_rw, asgn1_write,
+  TP_PROTO(dev_t dev, loff_t pos, size_t len, ssize_t ret, u64 ns),
+  TP_ARGS(dev, pos, len, ret, ns)
+);
+
+TRACE_EVENT(asgn1_lseek,
+
+  TP_PROTO(dev_t dev, loff_t offset, int whence, loff_t ret),
+
+  TP_ARGS(dev, offset, whence, ret),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(loff_t, offset)
+    __field(int, whence)
+    __field(loff_t, ret)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->offset = offset;
+    __entry->whence = whence;
+    __entry->ret = ret;
+  ),
+
+  TP_printk("dev=%d:%d offset=%lld whence=%d ret=%lld",
+            MAJOR(__entry->dev), MINOR(__entry->dev), __entry->offset,
+            __entry->whence, __entry->ret)
+);
+
+TRACE_EVENT(asgn1_mmap,
+
+  TP_PROTO(dev_t dev, unsigned long pgoff, unsigned long pages, int ret,
+           u64 ns),
+
+  TP_ARGS(dev, pgoff, pages, ret, ns),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, pgoff)
+    __field(unsigned long, pages)
+    __field(int, ret)
+    __field(u64, ns)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->pgoff = pgoff;
+    __entry->pages = pages;
+    __entry->ret = ret;
+    __entry->ns = ns;
+  ),
+
+  TP_printk("dev=%d:%d pgoff=%lu pages=%lu ret=%d ns=%llu",
+            MAJOR(__entry->dev), MINOR(__entry->dev), __entry->pgoff,
+            __entry->pages, __entry->ret, __entry->ns)
+);
+
+TRACE_EVENT(asgn1_fault,
+
+  TP_PROTO(dev_t dev, unsigned long pgoff, bool write, unsigned int ret,
+           u64 ns),
+
+  TP_ARGS(dev, pgoff, write, ret, ns),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(unsigned long, pgoff)
+    __field(bool, write)
+    __field(unsigned int, ret)
+    __field(u64, ns)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->pgoff = pgoff;
+    __entry->write = write;
+    __entry->ret = ret;
+    __entry->ns = ns;
+  ),
+
+  TP_printk("dev=%d:%d pgoff=%lu %s ret=0x%x ns=%llu",
+            MAJOR(__entry->dev), MINOR(__entry->dev), __entry->pgoff,
+            __entry->write ? "write" : "read", __entry->ret, __entry->ns)
+);
+
+TRACE_EVENT(asgn1_page_alloc,
+
+  TP_PROTO(dev_t dev, int order, int nr, int got),
+
+  TP_ARGS(dev, order, nr, got),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(int, order)
+    __field(int, nr)
+    __field(int, got)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->order = order;
+    __entry->nr = nr;
+    __entry->got = got;
+  ),
+
+  TP_printk("dev=%d:%d order=%d nr=%d got=%d",
+            MAJOR(__entry->dev), MINOR(__entry->dev), __entry->order,
+            __entry->nr, __entry->got)
+);
+
+DECLARE_EVENT_CLASS(asgn1_trim,
+
+  TP_PROTO(dev_t dev, loff_t offset, loff_t len, int freed),
+
+  TP_ARGS(dev, offset, len, freed),
+
+  TP_STRUCT__entry(
+    __field(dev_t, dev)
+    __field(loff_t, offset)
+    __field(loff_t, len)
+    __field(int, freed)
+  ),
+
+  TP_fast_assign(
+    __entry->dev = dev;
+    __entry->offset = offset;
+    __entry->len = len;
+    __entry->freed = freed;
+  ),
+
+  TP_printk("dev=%d:%d offset=%lld len=%lld freed=%d",
+            MAJOR(__entry->dev), MINOR(__entry->dev), __entry->offset,
+            __entry->len, __entry->freed)
+);
+
+/* len is the old data size less the new one */
+DEFINE_EVENT(asgn1_trim, asgn1_truncate,
+  TP_PROTO(dev_t dev, loff_t offset, loff_t len, int freed),
+  TP_ARGS(dev, offset, len, freed)
+);
+
+DEFINE_EVENT(asgn1_trim, asgn1_punch_hole,
+  TP_PROTO(dev_t dev, loff_t offset, loff_t len, int freed),
+  TP_ARGS(dev, offset, len, freed)
+);
+
+#endif /* _ASGN1_TRACE_H */
+
+/* this header is not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE asgn1_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include "bench.h"
+#include "uring.h"
+
+/*
+ * Read throughput of /dev/asgn1 through read(), readv() and io_uring.
+ *
+ * The device is filled with size_mb MiB, then read back in block-sized
+ * requests three ways: plain read(), readv() splitting each block into
+ * SEGMENTS iovecs, and io_uring with QUEUE_DEPTH reads in flight. io_uring
+ * is driven through the raw system calls so no liburing is needed.
+ *
+ * usage: iter_bench [size_mb] [block_kb] [device]
+ */
+
+#define SEGMENTS 16
+#define QUEUE_DEPTH 8
+
+static void report(const char *name, size_t bytes, double elapsed)
+{
+    printf("%-10s %10.1f MiB/s\n", name, bytes / elapsed / (1024 * 1024));
+}
+
+int main(int argc, char **argv)
+{
+    char *filename = "/dev/asgn1";
+    size_t size = 64UL * 1024 * 1024, block = 64 * 1024, done;
+    struct iovec iov[SEGMENTS];
+    struct uring ring;
+    unsigned inflight, i;
+    double start;
+    char *buf;
+    int fd, res;
+
+    if (argc > 1)
+        size = strtoul(argv[1], NULL, 0) * 1024 * 1024;
+    if (argc > 2)
+        block = strtoul(argv[2], NULL, 0) * 1024;
+    if (argc > 3)
+        filename = argv[3];
+
+    if (block % SEGMENTS || size % block) {
+        fprintf(stderr, "size must be a multiple of block, and block of %d\n",
+                SEGMENTS);
+        exit(1);
+    }
+    assert((buf = malloc(block * QUEUE_DEPTH)));
+    memset(buf, 0x3c, block);
+
+    /* truncate and fill the device */
+    if ((fd = open(filename, O_WRONLY)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    for (done = 0; done < size; done += block) {
+        if (write(fd, buf, block) != (ssize_t)block) {
+            fprintf(stderr, "write problem:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    close(fd);
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    printf("%zu MiB in %zu KiB blocks\n", size >> 20, block >> 10);
+
+    start = now_sec();
+    for (done = 0; done < size; done += block) {
+        if (pread(fd, buf, block, done) != (ssize_t)block) {
+            fprintf(stderr, "read problem:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    report("read", size, now_sec() - start);
+
+    for (i = 0; i < SEGMENTS; i++) {
+        iov[i].iov_base = buf + i * (block / SEGMENTS);
+        iov[i].iov_len = block / SEGMENTS;
+    }
+    start = now_sec();
+    for (done = 0; done < size; done += block) {
+        if (preadv(fd, iov, SEGMENTS, done) != (ssize_t)block) {
+            fprintf(stderr, "readv problem:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    report("readv", size, now_sec() - start);
+
+    if (uring_init(&ring, QUEUE_DEPTH) < 0) {
+        fprintf(stderr, "io_uring unavailable:  %s\n", strerror(errno));
+        return 0;
+    }
+    start = now_sec();
+    done = 0;
+    for (inflight = 0; inflight < QUEUE_DEPTH && done < size; inflight++) {
+        uring_queue(&ring, IORING_OP_READ, fd, buf + inflight * block,
+                    block, done, 0);
+        done += block;
+    }
+    res = uring_submit_and_wait(&ring, inflight, NULL);
+    for (;;) {
+        if (res != (int)block) {
+            fprintf(stderr, "io_uring read problem:  %s\n", strerror(-res));
+            exit(1);
+        }
+        inflight--;
+        if (done < size) {
+            uring_queue(&ring, IORING_OP_READ, fd, buf, block, done, 0);
+            done += block;
+            inflight++;
+            res = uring_submit_and_wait(&ring, 1, NULL);
+        } else if (inflight) {
+            res = uring_submit_and_wait(&ring, 0, NULL);
+        } else {
+            break;
+        }
+    }
+    report("io_uring", size, now_sec() - start);
+
+    close(fd);
+    return 0;
+}
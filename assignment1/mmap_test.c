@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <malloc.h>
+#include <time.h>
 
 //#define MMAP_DEV_CMD_GET_BUFSIZE 1  /* defines our IOCTL cmd */
 #define MYIOC_TYPE 'k'
@@ -82,6 +83,69 @@ void read_and_compare (int fd, char *read_buf, char *mmap_buf,
 
 #define SIZE 1024 * 64
 
+static double now_usec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Time mmap() of a device holding size_mb MiB, then the cost of touching
+ * every page of the mapping for the first time. Load the module with
+ * eager_mmap=1 to measure the eager path, and without it for the
+ * demand-faulted one.
+ */
+int mmap_bench (char *filename, unsigned long size_mb)
+{
+    unsigned long size = size_mb * 1024 * 1024;
+    unsigned long page = sysconf (_SC_PAGESIZE);
+    unsigned long i, sum = 0;
+    double t0, t1, t2, t3;
+    char *buf, *mmap_buf;
+    int fd;
+
+    if ((fd = open (filename, O_RDWR)) < 0) {
+        fprintf (stderr, "open of %s failed:  %s\n", filename,
+                 strerror (errno));
+        exit (1);
+    }
+
+    assert((buf = malloc(page)));
+    memset (buf, 0x5a, page);
+    for (i = 0; i < size; i += page)
+        my_fwrite (fd, buf, page);
+
+    t0 = now_usec ();
+    mmap_buf = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    t1 = now_usec ();
+    if (mmap_buf == (char *)MAP_FAILED) {
+        fprintf (stderr, "mmap of %s failed:  %s\n", filename,
+                 strerror (errno));
+        exit (1);
+    }
+
+    for (i = 0; i < size; i += page)
+        sum += mmap_buf[i];
+    t2 = now_usec ();
+
+    /* second pass: everything is mapped now, so this is the floor */
+    for (i = 0; i < size; i += page)
+        sum += mmap_buf[i];
+    t3 = now_usec ();
+
+    printf ("size %lu MiB: mmap() %.1f us, first touch %.1f us "
+            "(%.3f us/page), second touch %.1f us [sum %lu]\n",
+            size_mb, t1 - t0, t2 - t1, (t2 - t1) / (size / page), t3 - t2,
+            sum);
+
+    munmap (mmap_buf, size);
+    close (fd);
+    free (buf);
+    return 0;
+}
+
 int main (int argc, char **argv)
 {
     unsigned long i, j;
@@ -91,6 +155,13 @@ int main (int argc, char **argv)
 
     srandom (getpid ());
 
+    /* mmap_test -b <MiB> [device] runs the mmap latency benchmark */
+    if (argc > 2 && strcmp (argv[1], "-b") == 0) {
+        if (argc > 3)
+            filename = argv[3];
+        return mmap_bench (filename, strtoul (argv[2], NULL, 0));
+    }
+
     if (argc > 1)
         filename = argv[1];
 
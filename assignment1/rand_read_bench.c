@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "bench.h"
+
+/*
+ * Random 4 KiB read benchmark for /dev/asgn1.
+ *
+ * For each device size from MIN_SIZE up to max_mb MiB (doubling), the
+ * device is truncated by an O_WRONLY open, filled sequentially, and then
+ * NREADS page-aligned 4 KiB reads are issued at random offsets. With the
+ * old linked page list the cost per read grows with the device size; with
+ * the page index it should stay flat.
+ *
+ * usage: rand_read_bench [max_mb] [device]
+ */
+
+#define BLOCK 4096
+#define MIN_SIZE (1024 * 1024)
+#define NREADS 20000
+
+static void fill_device(const char *filename, size_t size, char *buf)
+{
+    size_t done;
+    ssize_t ret;
+    int fd;
+
+    if ((fd = open(filename, O_WRONLY)) < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    for (done = 0; done < size; done += ret) {
+        ret = write(fd, buf, BLOCK);
+        if (ret <= 0) {
+            fprintf(stderr, "write problem:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    char *filename = "/dev/asgn1";
+    char buf[BLOCK];
+    size_t max_size = 256UL * 1024 * 1024;
+    size_t size;
+    double start, elapsed;
+    int fd, i;
+
+    if (argc > 1)
+        max_size = strtoul(argv[1], NULL, 0) * 1024 * 1024;
+    if (argc > 2)
+        filename = argv[2];
+
+    srandom(getpid());
+    memset(buf, 0xa5, sizeof(buf));
+
+    printf("%12s %12s %12s\n", "size_kib", "reads/s", "usec/read");
+    for (size = MIN_SIZE; size <= max_size; size *= 2) {
+        fill_device(filename, size, buf);
+
+        if ((fd = open(filename, O_RDONLY)) < 0) {
+            fprintf(stderr, "open of %s failed:  %s\n", filename,
+                    strerror(errno));
+            exit(1);
+        }
+
+        start = now_sec();
+        for (i = 0; i < NREADS; i++) {
+            off_t off = (random() % (size / BLOCK)) * BLOCK;
+
+            if (pread(fd, buf, BLOCK, off) != BLOCK) {
+                fprintf(stderr, "read problem at %ld:  %s\n", (long)off,
+                        strerror(errno));
+                exit(1);
+            }
+        }
+        elapsed = now_sec() - start;
+        close(fd);
+
+        printf("%12zu %12.0f %12.2f\n", size / 1024, NREADS / elapsed,
+               elapsed * 1e6 / NREADS);
+    }
+    return 0;
+}
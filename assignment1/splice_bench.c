@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "bench.h"
+
+/*
+ * Copy throughput out of /dev/asgn1: read() + write() against splice().
+ *
+ * The device is filled with size_mb MiB and then copied to output twice:
+ * once through a user buffer of block_kb KiB with read() and write(), and
+ * once with splice() from the device into a pipe of the same size and
+ * from the pipe on to output, which lends the device pages to the pipe
+ * instead of copying them. output defaults to /dev/null, which measures
+ * the device side alone; a file on tmpfs or a socket shows the whole
+ * copy.
+ *
+ * usage: splice_bench [size_mb] [block_kb] [output] [device]
+ */
+
+static int open_or_die(const char *filename, int flags)
+{
+    int fd = open(filename, flags, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+static void report(const char *name, size_t bytes, double elapsed)
+{
+    printf("%-12s %10.1f MiB/s\n", name, bytes / elapsed / (1024 * 1024));
+}
+
+int main(int argc, char **argv)
+{
+    char *filename = "/dev/asgn1", *output = "/dev/null";
+    size_t size = 256UL * 1024 * 1024, block = 1024 * 1024, done;
+    int fd, out, pipefd[2];
+    double start;
+    ssize_t n, m;
+    char *buf;
+
+    if (argc > 1)
+        size = strtoul(argv[1], NULL, 0) * 1024 * 1024;
+    if (argc > 2)
+        block = strtoul(argv[2], NULL, 0) * 1024;
+    if (argc > 3)
+        output = argv[3];
+    if (argc > 4)
+        filename = argv[4];
+
+    if (!block || size % block) {
+        fprintf(stderr, "size must be a multiple of block\n");
+        exit(1);
+    }
+    assert((buf = malloc(block)));
+    memset(buf, 0x3c, block);
+
+    /* truncate and fill the device */
+    fd = open_or_die(filename, O_WRONLY);
+    for (done = 0; done < size; done += block) {
+        if (write(fd, buf, block) != (ssize_t)block) {
+            fprintf(stderr, "write problem:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    close(fd);
+
+    printf("%zu MiB in %zu KiB blocks to %s\n", size >> 20, block >> 10,
+           output);
+
+    fd = open_or_die(filename, O_RDONLY);
+    out = open_or_die(output, O_WRONLY | O_CREAT | O_TRUNC);
+    start = now_sec();
+    for (done = 0; done < size; done += n) {
+        n = read(fd, buf, block);
+        if (n <= 0 || write(out, buf, n) != n) {
+            fprintf(stderr, "read/write problem:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    report("read+write", size, now_sec() - start);
+    close(out);
+
+    if (pipe(pipefd) < 0) {
+        fprintf(stderr, "pipe failed:  %s\n", strerror(errno));
+        exit(1);
+    }
+    /* best effort: a pipe larger than the user limit is refused */
+    fcntl(pipefd[1], F_SETPIPE_SZ, block);
+
+    out = open_or_die(output, O_WRONLY | O_CREAT | O_TRUNC);
+    lseek(fd, 0, SEEK_SET);
+    start = now_sec();
+    for (done = 0; done < size; done += n) {
+        n = splice(fd, NULL, pipefd[1], NULL, block, SPLICE_F_MOVE);
+        if (n <= 0) {
+            fprintf(stderr, "splice from device problem:  %s\n",
+                    n ? strerror(errno) : "early end of data");
+            exit(1);
+        }
+        for (m = 0; m < n;) {
+            ssize_t k = splice(pipefd[0], NULL, out, NULL, n - m,
+                               SPLICE_F_MOVE);
+
+            if (k <= 0) {
+                fprintf(stderr, "splice to output problem:  %s\n",
+                        strerror(errno));
+                exit(1);
+            }
+            m += k;
+        }
+    }
+    report("splice", size, now_sec() - start);
+
+    close(out);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(fd);
+    return 0;
+}
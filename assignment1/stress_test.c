@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+/*
+ * Multi-process stress test for /dev/asgn1.
+ *
+ * Each writer owns a disjoint region of REGION_PAGES pages and repeatedly
+ * rewrites it with a pattern unique to (writer, iteration), reading it
+ * back after every write. Readers concurrently read random pages from any
+ * region and check that every 64-bit word is tagged with the right writer
+ * and word position, so data landing in the wrong place or a lost page is
+ * caught even though the iteration number may change mid-read.
+ *
+ * usage: stress_test [writers] [readers] [iterations] [device]
+ */
+
+#define MYIOC_TYPE 'k'
+#define SET_NPROC_OP 1
+#define ASGN1_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int)
+
+#define PAGE 4096
+#define REGION_PAGES 64
+#define REGION_SIZE (REGION_PAGES * PAGE)
+#define WORDS (REGION_SIZE / sizeof(uint64_t))
+
+static uint64_t tag(unsigned writer, unsigned iter, size_t word)
+{
+    return ((uint64_t)writer << 56) | ((uint64_t)(iter & 0xffffff) << 32) |
+        (uint32_t)word;
+}
+
+static int check_word(uint64_t v, unsigned writer, size_t word)
+{
+    return (v >> 56) == writer && (uint32_t)v == (uint32_t)word;
+}
+
+static int open_device(const char *filename, int flags)
+{
+    int fd;
+
+    while ((fd = open(filename, flags)) < 0 && errno == EBUSY)
+        usleep(1000);
+    if (fd < 0) {
+        fprintf(stderr, "open of %s failed:  %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+static int writer(const char *filename, unsigned id, unsigned iterations)
+{
+    uint64_t *buf, *check;
+    off_t base = (off_t)id * REGION_SIZE;
+    unsigned iter;
+    size_t i;
+    int fd = open_device(filename, O_RDWR);
+
+    assert((buf = malloc(REGION_SIZE)));
+    assert((check = malloc(REGION_SIZE)));
+
+    for (iter = 0; iter < iterations; iter++) {
+        for (i = 0; i < WORDS; i++)
+            buf[i] = tag(id, iter, i);
+
+        if (pwrite(fd, buf, REGION_SIZE, base) != REGION_SIZE) {
+            fprintf(stderr, "writer %u: write problem:  %s\n", id,
+                    strerror(errno));
+            return 1;
+        }
+        if (pread(fd, check, REGION_SIZE, base) != REGION_SIZE) {
+            fprintf(stderr, "writer %u: read problem:  %s\n", id,
+                    strerror(errno));
+            return 1;
+        }
+        if (memcmp(buf, check, REGION_SIZE) != 0) {
+            fprintf(stderr, "writer %u: miscompare in iteration %u\n", id, iter);
+            return 1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static int reader(const char *filename, unsigned id, unsigned nwriters,
+                  unsigned iterations)
+{
+    uint64_t buf[PAGE / sizeof(uint64_t)];
+    unsigned iter, region, page;
+    size_t i, first;
+    int fd = open_device(filename, O_RDONLY);
+
+    srandom(getpid());
+    for (iter = 0; iter < iterations * REGION_PAGES; iter++) {
+        region = random() % nwriters;
+        page = random() % REGION_PAGES;
+        first = (size_t)page * PAGE / sizeof(uint64_t);
+
+        if (pread(fd, buf, PAGE, (off_t)region * REGION_SIZE + page * PAGE)
+            != PAGE) {
+            fprintf(stderr, "reader %u: read problem:  %s\n", id,
+                    strerror(errno));
+            return 1;
+        }
+        for (i = 0; i < PAGE / sizeof(uint64_t); i++) {
+            if (!check_word(buf[i], region, first + i)) {
+                fprintf(stderr, "reader %u: bad word %#llx in region %u "
+                        "page %u\n", id, (unsigned long long)buf[i], region,
+                        page);
+                return 1;
+            }
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned nwriters = 4, nreaders = 4, iterations = 1000;
+    unsigned i, failed = 0;
+    char *filename = "/dev/asgn1";
+    uint64_t *buf;
+    size_t w;
+    int nproc, fd, status;
+    pid_t pid;
+
+    if (argc > 1)
+        nwriters = atoi(argv[1]);
+    if (argc > 2)
+        nreaders = atoi(argv[2]);
+    if (argc > 3)
+        iterations = atoi(argv[3]);
+    if (argc > 4)
+        filename = argv[4];
+
+    if (nwriters == 0 || nwriters > 255) {
+        fprintf(stderr, "writers must be between 1 and 255\n");
+        exit(1);
+    }
+
+    /* truncate the device and lay down iteration 0 for every region, so
+       readers never see unwritten data */
+    fd = open_device(filename, O_WRONLY);
+    nproc = nwriters + nreaders + 1;
+    if (ioctl(fd, ASGN1_SET_NPROC, &nproc) < 0) {
+        fprintf(stderr, "ioctl failed:  %s\n", strerror(errno));
+        exit(1);
+    }
+    assert((buf = malloc(REGION_SIZE)));
+    for (i = 0; i < nwriters; i++) {
+        for (w = 0; w < WORDS; w++)
+            buf[w] = tag(i, 0, w);
+        if (write(fd, buf, REGION_SIZE) != REGION_SIZE) {
+            fprintf(stderr, "write problem:  %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    close(fd);
+
+    for (i = 0; i < nwriters + nreaders; i++) {
+        pid = fork();
+        if (pid < 0) {
+            perror("fork()");
+            exit(1);
+        }
+        if (pid == 0) {
+            if (i < nwriters)
+                exit(writer(filename, i, iterations));
+            exit(reader(filename, i - nwriters, nwriters, iterations));
+        }
+    }
+
+    while ((pid = wait(&status)) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+
+    if (failed) {
+        fprintf(stderr, "%u of %u processes failed\n", failed,
+                nwriters + nreaders);
+        return 1;
+    }
+    printf("%u writers and %u readers completed %u iterations each\n",
+           nwriters, nreaders, iterations);
+    return 0;
+}